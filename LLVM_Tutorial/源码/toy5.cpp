@@ -1,36 +1,68 @@
 #include "/home/brook/桌面/llvm-project/llvm/examples/Kaleidoscope/include/KaleidoscopeJIT.h"
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/CrashRecoveryContext.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define KALEIDOSCOPE_LEX_SIMD
+#endif
+
 using namespace llvm;
 using namespace llvm::orc;
 
@@ -48,70 +80,638 @@ enum Token {
     tok_then = -7,
     tok_else = -8,
     tok_for = -9,
-    tok_in = -10
-};
-
-static std::string IdentifierStr;
-static double NumVal; 
-
-static int gettok() {
-  static int LastChar = ' ';
-
-  // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = getchar();
-
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
+    tok_in = -10,
+    tok_error = -11 // A malformed token the lexer has already diagnosed.
+};
+
+// Character classes for the lexer.  These are plain comparisons rather than
+// the <cctype> functions so the scanning loops don't call into libc.  '\0' is
+// in none of them, which lets the loops run into the buffer terminator.
+static inline bool isSpaceChar(char C) {
+  return C == ' ' || (C >= '\t' && C <= '\r');
+}
+static inline bool isDigitChar(char C) { return C >= '0' && C <= '9'; }
+static inline bool isAlphaChar(char C) {
+  return (C | 0x20) >= 'a' && (C | 0x20) <= 'z';
+}
+static inline bool isAlnumChar(char C) {
+  return isAlphaChar(C) || isDigitChar(C);
+}
+
+#ifdef KALEIDOSCOPE_LEX_SIMD
+// ScanVec - The widest byte vector the target is compiled for, and the handful
+// of operations the scanners below need on it.
+#if defined(__AVX2__)
+using ScanVec = __m256i;
+static constexpr size_t ScanWidth = 32;
+static inline ScanVec scanLoad(const char *P) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+}
+static inline ScanVec scanSplat(char C) { return _mm256_set1_epi8(C); }
+static inline ScanVec scanEq(ScanVec A, ScanVec B) {
+  return _mm256_cmpeq_epi8(A, B);
+}
+static inline ScanVec scanOr(ScanVec A, ScanVec B) {
+  return _mm256_or_si256(A, B);
+}
+static inline ScanVec scanSub(ScanVec A, ScanVec B) {
+  return _mm256_sub_epi8(A, B);
+}
+static inline ScanVec scanMinU(ScanVec A, ScanVec B) {
+  return _mm256_min_epu8(A, B);
+}
+static inline uint32_t scanMask(ScanVec A) {
+  return (uint32_t)_mm256_movemask_epi8(A);
+}
+#else
+using ScanVec = __m128i;
+static constexpr size_t ScanWidth = 16;
+static inline ScanVec scanLoad(const char *P) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+}
+static inline ScanVec scanSplat(char C) { return _mm_set1_epi8(C); }
+static inline ScanVec scanEq(ScanVec A, ScanVec B) {
+  return _mm_cmpeq_epi8(A, B);
+}
+static inline ScanVec scanOr(ScanVec A, ScanVec B) {
+  return _mm_or_si128(A, B);
+}
+static inline ScanVec scanSub(ScanVec A, ScanVec B) {
+  return _mm_sub_epi8(A, B);
+}
+static inline ScanVec scanMinU(ScanVec A, ScanVec B) {
+  return _mm_min_epu8(A, B);
+}
+static inline uint32_t scanMask(ScanVec A) {
+  return (uint32_t)_mm_movemask_epi8(A);
+}
+#endif
+
+static constexpr uint32_t ScanAllOnes = (uint32_t)((1ULL << ScanWidth) - 1);
+
+/// scanInRange - Lanes of V in [Lo, Hi], compared as unsigned bytes.
+static inline ScanVec scanInRange(ScanVec V, char Lo, char Hi) {
+  ScanVec Off = scanSub(V, scanSplat(Lo));
+  return scanEq(scanMinU(Off, scanSplat(Hi - Lo)), Off);
+}
+
+static inline uint32_t spaceMask(ScanVec V) {
+  return scanMask(
+      scanOr(scanEq(V, scanSplat(' ')), scanInRange(V, '\t', '\r')));
+}
+
+static inline uint32_t alnumMask(ScanVec V) {
+  ScanVec Lower = scanOr(V, scanSplat(0x20));
+  return scanMask(
+      scanOr(scanInRange(Lower, 'a', 'z'), scanInRange(V, '0', '9')));
+}
+
+static inline uint32_t lineEndMask(ScanVec V) {
+  return scanMask(
+      scanOr(scanEq(V, scanSplat('\n')), scanEq(V, scanSplat('\r'))));
+}
+#endif
+
+// The scanners below classify 32 bytes at a time on AVX2 builds and 16 with
+// SSE2 when SIMD is set, and finish the last partial chunk a byte at a time.
+
+/// skipSpace - Return the first non-whitespace character at or after P.
+static inline const char *skipSpace(const char *P, const char *End,
+                                    bool SIMD) {
+#ifdef KALEIDOSCOPE_LEX_SIMD
+  // Most tokens are separated by a single space, so only go wide for runs.
+  if (SIMD && isSpaceChar(*P) && isSpaceChar(P[1])) {
+    for (; End - P >= (ptrdiff_t)ScanWidth; P += ScanWidth)
+      if (uint32_t Stop = ~spaceMask(scanLoad(P)) & ScanAllOnes)
+        return P + countr_zero(Stop);
+  }
+#endif
+  while (isSpaceChar(*P))
+    ++P;
+  return P;
+}
+
+/// skipIdentifierTail - Return the first character at or after P that can't
+/// continue an identifier.
+static inline const char *skipIdentifierTail(const char *P, const char *End,
+                                             bool SIMD) {
+#ifdef KALEIDOSCOPE_LEX_SIMD
+  if (SIMD) {
+    for (; End - P >= (ptrdiff_t)ScanWidth; P += ScanWidth)
+      if (uint32_t Stop = ~alnumMask(scanLoad(P)) & ScanAllOnes)
+        return P + countr_zero(Stop);
+  }
+#endif
+  while (isAlnumChar(*P))
+    ++P;
+  return P;
+}
+
+/// skipToLineEnd - Return the first '\n' or '\r' at or after P, or End.
+static inline const char *skipToLineEnd(const char *P, const char *End,
+                                        bool SIMD) {
+#ifdef KALEIDOSCOPE_LEX_SIMD
+  if (SIMD) {
+    for (; End - P >= (ptrdiff_t)ScanWidth; P += ScanWidth)
+      if (uint32_t Stop = lineEndMask(scanLoad(P)))
+        return P + countr_zero(Stop);
+  }
+#endif
+  while (P != End && *P != '\n' && *P != '\r')
+    ++P;
+  return P;
+}
+
+namespace {
+struct Keyword {
+  std::string_view Spelling;
+  Token Tok;
+};
+} // end anonymous namespace
+
+/// Keywords - Every reserved word.  New keywords only need an entry here; the
+/// hash below is re-derived at compile time so lookups stay a single probe.
+static constexpr Keyword Keywords[] = {
+    {"def", tok_def},   {"extern", tok_extern}, {"if", tok_if},
+    {"then", tok_then}, {"else", tok_else},     {"for", tok_for},
+    {"in", tok_in},
+};
+
+static constexpr unsigned KeywordTableSize = 32;
+static constexpr size_t NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+static_assert(NumKeywords < KeywordTableSize, "grow KeywordTableSize");
+
+/// keywordHash - Hash on the length and the first and last characters, so
+/// classifying an identifier reads at most two of its bytes before the final
+/// comparison.
+static constexpr unsigned keywordHash(unsigned Seed, size_t Len, char First,
+                                      char Last) {
+  return ((unsigned char)First * Seed + (unsigned char)Last * (Seed >> 4) +
+          (unsigned)Len) %
+         KeywordTableSize;
+}
+
+namespace {
+/// KeywordTable - Slot[keywordHash(Seed, ...)] is the index into Keywords of
+/// the only keyword that can hash there, or -1.
+struct KeywordTable {
+  unsigned Seed = 0;
+  size_t MinLen = ~size_t(0), MaxLen = 0;
+  int8_t Slot[KeywordTableSize] = {};
+};
+} // end anonymous namespace
+
+/// buildKeywordTable - Search for a seed under which no two keywords collide.
+static constexpr KeywordTable buildKeywordTable() {
+  KeywordTable T;
+  for (const Keyword &K : Keywords) {
+    T.MinLen = std::min(T.MinLen, K.Spelling.size());
+    T.MaxLen = std::max(T.MaxLen, K.Spelling.size());
+  }
+  for (unsigned Seed = 1; Seed < 4096; ++Seed) {
+    for (int8_t &S : T.Slot)
+      S = -1;
+    bool Collision = false;
+    for (size_t I = 0; I != NumKeywords && !Collision; ++I) {
+      std::string_view Sp = Keywords[I].Spelling;
+      int8_t &S = T.Slot[keywordHash(Seed, Sp.size(), Sp.front(), Sp.back())];
+      Collision = S >= 0;
+      S = (int8_t)I;
+    }
+    if (!Collision) {
+      T.Seed = Seed;
+      return T;
+    }
+  }
+  return T;
+}
+
+static constexpr KeywordTable KeywordLookup = buildKeywordTable();
+static_assert(KeywordLookup.Seed != 0, "no perfect hash for the keywords");
+
+/// classifyIdentifier - Return the keyword token for Id, or tok_identifier.
+static inline int classifyIdentifier(StringRef Id) {
+  if (Id.size() < KeywordLookup.MinLen || Id.size() > KeywordLookup.MaxLen)
     return tok_identifier;
+  int Idx = KeywordLookup.Slot[keywordHash(KeywordLookup.Seed, Id.size(),
+                                           Id.front(), Id.back())];
+  if (Idx < 0 ||
+      Keywords[Idx].Spelling != std::string_view(Id.data(), Id.size()))
+    return tok_identifier;
+  return Keywords[Idx].Tok;
+}
+
+static inline bool isHexDigitChar(char C) {
+  return isDigitChar(C) || ((C | 0x20) >= 'a' && (C | 0x20) <= 'f');
+}
+
+namespace {
+
+/// SymbolID - An interned identifier.  Equal spellings have equal IDs, so the
+/// parser and the code generator compare and hash names as integers.
+using SymbolID = uint32_t;
+
+/// SymbolTable - Interns identifier spellings as dense SymbolIDs.  A spelling
+/// is copied once, the first time it is seen; later lookups only hash it.
+/// Thread safe, so that lexers on different threads can share one table and
+/// agree on IDs.  The lock is uncontended unless they do; lexers that run in
+/// parallel on one source each intern into a table of their own instead, and
+/// merge it in afterwards with one lock.
+class SymbolTable {
+  StringMap<SymbolID> IDs;
+  std::vector<StringRef> Names;
+  mutable std::mutex Mutex;
+
+public:
+  /// AnonExprSym - The name of the function wrapping a top-level expression,
+  /// interned up front so the parser never has to add names itself.
+  static constexpr SymbolID AnonExprSym = 0;
+
+  SymbolTable() { intern("__anon_expr"); }
+
+  SymbolID intern(StringRef Name) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto [It, Inserted] = IDs.try_emplace(Name, (SymbolID)Names.size());
+    if (Inserted)
+      Names.push_back(It->getKey());
+    return It->second;
+  }
+
+  /// getName - The spelling of ID.  It lives as long as the table, however
+  /// many names are added.
+  StringRef getName(SymbolID ID) const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Names[ID];
+  }
+  size_t size() const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Names.size();
+  }
+
+  /// merge - Intern every name of Local, in ID order, setting Map[ID] to the
+  /// ID each one has here.
+  void merge(const SymbolTable &Local, std::vector<SymbolID> &Map) {
+    std::scoped_lock Lock(Mutex, Local.Mutex);
+    Map.resize(Local.Names.size());
+    for (size_t I = 0, E = Local.Names.size(); I != E; ++I) {
+      auto [It, Inserted] =
+          IDs.try_emplace(Local.Names[I], (SymbolID)Names.size());
+      if (Inserted)
+        Names.push_back(It->getKey());
+      Map[I] = It->second;
+    }
+  }
+};
+
+/// Lexer - Turns a null terminated buffer into tokens.  When a source buffer
+/// is installed (an mmap'ed file or an in-memory string) the whole program is
+/// lexed straight out of it; otherwise standard input is read one line at a
+/// time into LineBuf.  Tokens never span a newline, so a line always holds
+/// complete tokens.  All state lives in the object, so independent sources
+/// can be lexed on different threads.  Identifiers are interned into Symbols
+/// as they are lexed; lexers on different threads may share one table.
+class Lexer {
+  SymbolTable &Symbols;
+  std::unique_ptr<MemoryBuffer> SourceBuf;
+  std::string LineBuf;
+  const char *CurPtr = "";
+  const char *BufEnd = CurPtr;
+  const char *TokStart = CurPtr; // Start of the last token returned
+
+  StringRef IdentifierStr;   // Filled in if tok_identifier
+  SymbolID IdentifierSym = 0; // Filled in if tok_identifier
+  double NumVal = 0;          // Filled in if tok_number
+
+  bool UseSIMD = true;
+
+  /// Diagnostic - Where the error for the last token goes, if it is to be
+  /// kept rather than printed.
+  std::string *Diagnostic = nullptr;
+
+  bool refillBuffer();
+  int lexNumber();
+  void error(const Twine &Msg);
+
+public:
+  explicit Lexer(SymbolTable &Symbols) : Symbols(Symbols) {}
+  Lexer(SymbolTable &Symbols, std::unique_ptr<MemoryBuffer> Buf)
+      : Symbols(Symbols) {
+    setSource(std::move(Buf));
+  }
+  Lexer(const Lexer &) = delete;
+  Lexer &operator=(const Lexer &) = delete;
+
+  /// setSource - Lex from Buf instead of standard input.  IdentifierStr
+  /// points into the buffer, so nothing is copied per token.
+  void setSource(std::unique_ptr<MemoryBuffer> Buf) {
+    SourceBuf = std::move(Buf);
+    CurPtr = SourceBuf->getBufferStart();
+    BufEnd = SourceBuf->getBufferEnd();
+  }
+
+  /// setUseSIMD - Only cleared by the lexer benchmark, to time the scalar
+  /// scanning loops.
+  void setUseSIMD(bool V) { UseSIMD = V; }
+
+  /// setDiagnostic - Store the error for each token in Out, without the
+  /// "Error: " prefix, instead of printing it.  Out is only ever appended to.
+  void setDiagnostic(std::string *Out) { Diagnostic = Out; }
+
+  StringRef getIdentifier() const { return IdentifierStr; }
+  SymbolID getIdentifierSym() const { return IdentifierSym; }
+  double getNumVal() const { return NumVal; }
+
+  /// getTokenText - The spelling of the last token returned.
+  StringRef getTokenText() const {
+    return StringRef(TokStart, CurPtr - TokStart);
+  }
+
+  int gettok();
+};
+
+/// TokenBuffer - Every token of a source, lexed in one pass and stored as
+/// parallel arrays (kind, offset, length, literal index) so that a parser can
+/// walk them by index, look ahead and back up for free, and the lexing cost
+/// can be measured on its own.  Identifier text stays in the source buffer,
+/// which the token buffer owns.  The literal index of a tok_number is its
+/// position in Literals, and that of a tok_identifier its SymbolID.  The last
+/// token is always tok_eof.  Lexer errors are kept with the tokens they were
+/// found in, for the parser to report when it reaches them, in the order that
+/// lexing on the fly would have printed them.
+///
+/// With Jobs other than 1, the source is cut at line ends into pieces that
+/// are lexed on a thread pool, each interning into a symbol table of its own.
+/// The pieces are then joined in order and their tables merged into Symbols,
+/// so the tokens and SymbolIDs are the same as a single lexer's.
+class TokenBuffer {
+  std::unique_ptr<MemoryBuffer> Source;
+  std::vector<int16_t> Kinds;
+  std::vector<uint32_t> Offsets;
+  std::vector<uint32_t> Lengths;
+  std::vector<uint32_t> LitIndices;
+  std::vector<double> Literals;
+  DenseMap<uint32_t, std::string> Diagnostics;
+
+  TokenBuffer() = default;
+
+  /// lex - Append the tokens of Text, a run of whole lines, with offsets from
+  /// its start.  The tok_eof at its end is only kept if Last.
+  void lex(SymbolTable &Symbols, StringRef Text, bool Last);
+
+  /// copyPart - Store the tokens of Part, which starts Offset bytes into the
+  /// source, from token FirstToken and literal FirstLiteral on, renumbering
+  /// its identifiers through Map.  The arrays must already be large enough.
+  void copyPart(const TokenBuffer &Part, uint32_t FirstToken,
+                uint32_t FirstLiteral, uint32_t Offset,
+                ArrayRef<SymbolID> Map);
+
+public:
+  TokenBuffer(SymbolTable &Symbols, std::unique_ptr<MemoryBuffer> Buf,
+              unsigned Jobs = 1);
+
+  size_t size() const { return Kinds.size(); }
+  int getKind(size_t I) const { return Kinds[I]; }
+  StringRef getText(size_t I) const {
+    return Source->getBuffer().substr(Offsets[I], Lengths[I]);
+  }
+  SymbolID getSymbol(size_t I) const { return LitIndices[I]; }
+  double getNumVal(size_t I) const { return Literals[LitIndices[I]]; }
+
+  /// getDiagnostic - The lexer's error for token I, or null if it had none.
+  const std::string *getDiagnostic(size_t I) const {
+    if (Diagnostics.empty())
+      return nullptr;
+    auto It = Diagnostics.find((uint32_t)I);
+    return It == Diagnostics.end() ? nullptr : &It->second;
   }
+};
+
+} // end anonymous namespace
+
+/// refillBuffer - Read the next line of standard input.  Returns false at the
+/// end of the input.
+bool Lexer::refillBuffer() {
+  if (SourceBuf || !std::getline(std::cin, LineBuf))
+    return false;
+  LineBuf += '\n';
+  CurPtr = LineBuf.c_str();
+  BufEnd = CurPtr + LineBuf.size();
+  return true;
+}
 
-  if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
+/// lexNumber - Lex a numeric literal starting at CurPtr:
+///   number ::= [0-9.]+ ([eE] [+-]? [0-9]+)?
+///          ::= '0' [xX] [0-9a-fA-F.]+ ([pP] [+-]? [0-9]+)?
+/// The value is converted in place with std::from_chars, which neither needs
+/// a terminated copy nor looks at the locale.  All of the digits and dots are
+/// taken before converting, so "1.2.3" is one malformed literal rather than
+/// "1.2" followed by ".3".  A literal too small for a double becomes zero or
+/// a denormal, as strtod makes it; one too large to be finite is an error
+/// rather than infinity.
+int Lexer::lexNumber() {
+  bool Hex = CurPtr[0] == '0' && (CurPtr[1] | 0x20) == 'x';
+  const char *Digits = Hex ? CurPtr + 2 : CurPtr;
+
+  CurPtr = Digits;
+  while (*CurPtr == '.' || (Hex ? isHexDigitChar(*CurPtr)
+                                : isDigitChar(*CurPtr)))
+    ++CurPtr;
+
+  // The exponent is only part of the literal if it has digits; otherwise
+  // "2e" is the number 2 followed by the identifier "e".
+  if ((*CurPtr | 0x20) == (Hex ? 'p' : 'e')) {
+    const char *P = CurPtr + 1;
+    if (*P == '+' || *P == '-')
+      ++P;
+    if (isDigitChar(*P)) {
+      do
+        ++P;
+      while (isDigitChar(*P));
+      CurPtr = P;
+    }
+  }
 
-    NumVal = strtod(NumStr.c_str(), nullptr);
+  auto [End, EC] =
+      std::from_chars(Digits, CurPtr, NumVal,
+                      Hex ? std::chars_format::hex : std::chars_format::general);
+  if (EC == std::errc() && End == CurPtr)
     return tok_number;
+
+  if (EC != std::errc::result_out_of_range) {
+    error("malformed number literal '" + getTokenText() + "'");
+    return tok_error;
+  }
+
+  // from_chars reports underflow and denormal results as out of range too,
+  // and leaves NumVal alone.  Only then, let strtod round the literal.
+  NumVal = strtod(getTokenText().str().c_str(), nullptr);
+  if (std::isinf(NumVal)) {
+    error("number literal '" + getTokenText() + "' is out of range");
+    return tok_error;
+  }
+  return tok_number;
+}
+
+/// error - Report Msg against the current token.
+void Lexer::error(const Twine &Msg) {
+  if (Diagnostic)
+    *Diagnostic += Msg.str();
+  else
+    fprintf(stderr, "Error: %s\n", Msg.str().c_str());
+}
+
+/// gettok - Return the next token from the current source.
+int Lexer::gettok() {
+  while (true) {
+    // Skip any whitespace.
+    CurPtr = skipSpace(CurPtr, BufEnd, UseSIMD);
+
+    // Check for end of buffer.  Don't eat the terminator.
+    TokStart = CurPtr;
+    if (CurPtr == BufEnd) {
+      if (refillBuffer())
+        continue;
+      return tok_eof;
+    }
+
+    if (isAlphaChar(*CurPtr)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+      CurPtr = skipIdentifierTail(CurPtr + 1, BufEnd, UseSIMD);
+      IdentifierStr = StringRef(TokStart, CurPtr - TokStart);
+      int Tok = classifyIdentifier(IdentifierStr);
+      if (Tok == tok_identifier)
+        IdentifierSym = Symbols.intern(IdentifierStr);
+      return Tok;
+    }
+
+    if (isDigitChar(*CurPtr) || *CurPtr == '.')
+      return lexNumber();
+
+    if (*CurPtr == '#') {
+      // Comment until end of line.
+      CurPtr = skipToLineEnd(CurPtr, BufEnd, UseSIMD);
+      continue;
+    }
+
+    // Otherwise, just return the character as its ascii value.
+    return (unsigned char)*CurPtr++;
   }
+}
 
-  if (LastChar == '#') {
-    // Comment until end of line.
-    do
-      LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+TokenBuffer::TokenBuffer(SymbolTable &Symbols,
+                         std::unique_ptr<MemoryBuffer> Buf, unsigned Jobs)
+    : Source(std::move(Buf)) {
+  assert(Source->getBufferSize() <= UINT32_MAX && "offsets are 32 bits");
+  StringRef Text = Source->getBuffer();
+  ThreadPoolStrategy Strategy = hardware_concurrency(Jobs);
+  unsigned Threads = Jobs == 1 ? 1 : Strategy.compute_thread_count();
+
+  // Several pieces per thread, so that one slow piece doesn't hold up the
+  // rest, but none so small that starting it costs more than lexing it.
+  size_t PieceSize =
+      std::max<size_t>(Text.size() / (Threads * 8) + 1, 256 << 10);
+  if (Threads == 1 || Text.size() <= PieceSize) {
+    lex(Symbols, Text, /*Last=*/true);
+    return;
+  }
 
-    if (LastChar != EOF)
-      return gettok();
+  // Cut after a line end that a token follows directly: no token spans a
+  // line end, and a piece's lexer stops skipping space exactly at its end,
+  // where there is no terminator.
+  std::vector<StringRef> Pieces;
+  while (!Text.empty()) {
+    size_t End = std::min(PieceSize, Text.size()) - 1;
+    while ((End = Text.find('\n', End)) != StringRef::npos &&
+           End + 1 != Text.size() && isSpaceChar(Text[End + 1]))
+      ++End;
+    End = End == StringRef::npos ? Text.size() : End + 1;
+    Pieces.push_back(Text.take_front(End));
+    Text = Text.drop_front(End);
+  }
+  std::unique_ptr<TokenBuffer[]> Parts(new TokenBuffer[Pieces.size()]);
+  std::vector<SymbolTable> Tables(Pieces.size());
+  ThreadPool Pool(Strategy);
+  for (size_t I = 0; I != Pieces.size(); ++I)
+    Pool.async([&, I] {
+      Parts[I].lex(Tables[I], Pieces[I], /*Last=*/I + 1 == Pieces.size());
+    });
+  Pool.wait();
+
+  // Merge the tables in order, so that IDs are numbered as one lexer would
+  // number them, and then copy the pieces into place in parallel.
+  std::vector<std::vector<SymbolID>> Maps(Pieces.size());
+  std::vector<uint32_t> FirstTokens(Pieces.size() + 1);
+  std::vector<uint32_t> FirstLiterals(Pieces.size() + 1);
+  for (size_t I = 0; I != Pieces.size(); ++I) {
+    Symbols.merge(Tables[I], Maps[I]);
+    FirstTokens[I + 1] = FirstTokens[I] + (uint32_t)Parts[I].size();
+    FirstLiterals[I + 1] =
+        FirstLiterals[I] + (uint32_t)Parts[I].Literals.size();
+    for (const auto &KV : Parts[I].Diagnostics)
+      Diagnostics[FirstTokens[I] + KV.first] = KV.second;
   }
+  Kinds.resize(FirstTokens.back());
+  Offsets.resize(FirstTokens.back());
+  Lengths.resize(FirstTokens.back());
+  LitIndices.resize(FirstTokens.back());
+  Literals.resize(FirstLiterals.back());
+  for (size_t I = 0; I != Pieces.size(); ++I)
+    Pool.async([&, I] {
+      copyPart(Parts[I], FirstTokens[I], FirstLiterals[I],
+               (uint32_t)(Pieces[I].data() - Source->getBufferStart()),
+               Maps[I]);
+    });
+  Pool.wait();
+}
+
+void TokenBuffer::lex(SymbolTable &Symbols, StringRef Text, bool Last) {
+  Lexer Lex(Symbols, MemoryBuffer::getMemBuffer(
+                         Text, "", /*RequiresNullTerminator=*/Last));
 
-  // Check for end of file.  Don't eat the EOF.
-  if (LastChar == EOF)
-    return tok_eof;
+  // A token every few bytes is typical; reserving avoids most regrowth.
+  size_t Estimate = Text.size() / 4 + 1;
+  Kinds.reserve(Estimate);
+  Offsets.reserve(Estimate);
+  Lengths.reserve(Estimate);
+  LitIndices.reserve(Estimate);
+
+  std::string Diagnostic;
+  Lex.setDiagnostic(&Diagnostic);
+
+  while (true) {
+    int Tok = Lex.gettok();
+    if (Tok == tok_eof && !Last)
+      break;
+    if (!Diagnostic.empty())
+      Diagnostics[(uint32_t)Kinds.size()] = std::move(Diagnostic);
+    Diagnostic.clear();
+    StringRef TokText = Lex.getTokenText();
+    Kinds.push_back((int16_t)Tok);
+    Offsets.push_back((uint32_t)(TokText.data() - Text.data()));
+    Lengths.push_back((uint32_t)TokText.size());
+    if (Tok == tok_identifier) {
+      LitIndices.push_back(Lex.getIdentifierSym());
+    } else {
+      LitIndices.push_back((uint32_t)Literals.size());
+      if (Tok == tok_number)
+        Literals.push_back(Lex.getNumVal());
+    }
+    if (Tok == tok_eof)
+      break;
+  }
+}
 
-  // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = getchar();
-  return ThisChar;
+void TokenBuffer::copyPart(const TokenBuffer &Part, uint32_t FirstToken,
+                           uint32_t FirstLiteral, uint32_t Offset,
+                           ArrayRef<SymbolID> Map) {
+  for (size_t I = 0, E = Part.size(); I != E; ++I) {
+    Kinds[FirstToken + I] = Part.Kinds[I];
+    Offsets[FirstToken + I] = Part.Offsets[I] + Offset;
+    Lengths[FirstToken + I] = Part.Lengths[I];
+    LitIndices[FirstToken + I] = Part.Kinds[I] == tok_identifier
+                                     ? Map[Part.LitIndices[I]]
+                                     : Part.LitIndices[I] + FirstLiteral;
+  }
+  llvm::copy(Part.Literals, Literals.begin() + FirstLiteral);
 }
 
 //===----------------------------------------------------------------------===//
@@ -120,12 +720,60 @@ static int gettok() {
 
 namespace {
 
-/// ExprAST - Base class for all expression nodes.
-class ExprAST {
+/// ASTArena - Owns the expression nodes of one top-level item.  Nodes and
+/// their argument arrays are bump-allocated and never freed one by one; the
+/// whole tree is released with the arena.  Nodes must therefore not own any
+/// memory themselves.
+class ASTArena {
+  BumpPtrAllocator Alloc;
+  size_t NumNodes = 0;
+
 public:
-  virtual ~ExprAST() = default;
+  template <typename NodeT, typename... ArgTs> NodeT *make(ArgTs &&...Args) {
+    static_assert(std::is_trivially_destructible<NodeT>::value,
+                  "arena nodes are never destroyed");
+    ++NumNodes;
+    return new (Alloc.Allocate<NodeT>()) NodeT(std::forward<ArgTs>(Args)...);
+  }
+
+  /// copyArray - Move a temporary list (such as call arguments) into the
+  /// arena.
+  template <typename T> ArrayRef<T> copyArray(ArrayRef<T> Elts) {
+    T *Mem = Alloc.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return ArrayRef<T>(Mem, Elts.size());
+  }
+
+  size_t getNumNodes() const { return NumNodes; }
+  size_t getNumSlabs() const { return Alloc.GetNumSlabs(); }
+  size_t getBytesAllocated() const { return Alloc.getBytesAllocated(); }
+};
+
+/// FoldMode - How far simplifyExpr may go.  Strict only folds where the result
+/// is exactly what the generated code would compute.  Fast also assumes there
+/// are no NaNs or infinities, ignores the sign of zero and reassociates.
+enum class FoldMode { None, Strict, Fast };
+
+/// ExprKind - The kinds of expression node, shared by the tree and FlatAST.
+enum class ExprKind : uint8_t { Number, Variable, Binary, Call, If, For };
+
+/// ExprAST - Base class for all expression nodes.  Nodes live in an ASTArena
+/// and refer to their children with plain pointers.  They are walked with an
+/// explicit stack, switching on the kind, so that no expression is too deep
+/// for the C++ stack.
+class ExprAST {
+  const ExprKind Kind;
+  bool Shared = false;
+  friend class SharedExprTable;
 
-  virtual Value *codegen() = 0;
+protected:
+  ExprAST(ExprKind Kind) : Kind(Kind) {}
+
+public:
+  ExprKind getKind() const { return Kind; }
+  /// isShared - Whether this is a pure node interned by a SharedExprTable,
+  /// which may appear any number of times in any number of functions.
+  bool isShared() const { return Shared; }
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -133,364 +781,1136 @@ class NumberExprAST : public ExprAST {
   double Val;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
+  NumberExprAST(double Val) : ExprAST(ExprKind::Number), Val(Val) {}
 
-  Value *codegen() override;
+  double getVal() const { return Val; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::Number;
+  }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  SymbolID Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
+  VariableExprAST(SymbolID Name) : ExprAST(ExprKind::Variable), Name(Name) {}
 
-  Value *codegen() override;
+  SymbolID getName() const { return Name; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::Variable;
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  const ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-
-  Value *codegen() override;
+  BinaryExprAST(char Op, const ExprAST *LHS, const ExprAST *RHS)
+      : ExprAST(ExprKind::Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+
+  char getOp() const { return Op; }
+  const ExprAST *getLHS() const { return LHS; }
+  const ExprAST *getRHS() const { return RHS; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::Binary;
+  }
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SymbolID Callee;
+  ArrayRef<const ExprAST *> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
+  CallExprAST(SymbolID Callee, ArrayRef<const ExprAST *> Args)
+      : ExprAST(ExprKind::Call), Callee(Callee), Args(Args) {}
 
-  Value *codegen() override;
+  SymbolID getCallee() const { return Callee; }
+  ArrayRef<const ExprAST *> getArgs() const { return Args; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::Call;
+  }
 };
 
 /// IfExprAST - Expression class for if/then/else.
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  const ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(std::unique_ptr<ExprAST> Cond,
-            std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-
-  Value *codegen() override;
+  IfExprAST(const ExprAST *Cond, const ExprAST *Then, const ExprAST *Else)
+      : ExprAST(ExprKind::If), Cond(Cond), Then(Then), Else(Else) {}
+
+  const ExprAST *getCond() const { return Cond; }
+  const ExprAST *getThen() const { return Then; }
+  const ExprAST *getElse() const { return Else; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::If;
+  }
 };
 
 /// ForExprAST - Expression class for for/in
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  SymbolID VarName;
+  const ExprAST *Start, *End, *Step, *Body;
 
 public:
-  ForExprAST(const std::string &VarName,
-              std::unique_ptr<ExprAST> Start,
-              std::unique_ptr<ExprAST> End,
-              std::unique_ptr<ExprAST> Step,
-              std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)),
-          End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
-
-  Value *codegen() override;
+  ForExprAST(SymbolID VarName, const ExprAST *Start, const ExprAST *End,
+             const ExprAST *Step, const ExprAST *Body)
+      : ExprAST(ExprKind::For), VarName(VarName), Start(Start), End(End),
+        Step(Step), Body(Body) {}
+
+  SymbolID getVarName() const { return VarName; }
+  const ExprAST *getStart() const { return Start; }
+  const ExprAST *getEnd() const { return End; }
+  const ExprAST *getStep() const { return Step; } // Null when omitted
+  const ExprAST *getBody() const { return Body; }
+  static bool classof(const ExprAST *E) {
+    return E->getKind() == ExprKind::For;
+  }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
 /// of arguments the function takes).
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
+  SymbolID Name;
+  std::vector<SymbolID> Args;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
+  PrototypeAST(SymbolID Name, std::vector<SymbolID> Args)
       : Name(Name), Args(std::move(Args)) {}
 
-  Function *codegen();
-  const std::string &getName() const { return Name; }
+  /// codegen - Declare the function, under IRName if one is given.
+  Function *codegen(StringRef IRName = StringRef());
+  SymbolID getName() const { return Name; }
+  ArrayRef<SymbolID> getArgs() const { return Args; }
 };
 
-/// FunctionAST - This class represents a function definition itself.
-class FunctionAST {
-  std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
-
+/// FlatAST - A function body as a flat array of 16-byte nodes that refer to
+/// their children by 32-bit index, for bodies of hundreds of thousands of
+/// nodes where the pointer-linked tree is too big and too scattered.  Code
+/// generation walks it the same way as the tree.  The meaning of a node's
+/// operands depends on its kind:
+///   Number:   A = index into Consts
+///   Variable: A = SymbolID
+///   Binary:   Op, A = LHS, B = RHS
+///   Call:     A = callee SymbolID, B = first argument in Extra, C = count
+///   If:       A = Cond, B = Then, C = Else
+///   For:      A = variable SymbolID, B = Start, End, Step, Body in Extra
+///             (Step is NoNode when omitted)
+class FlatAST {
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
-
-  Function *codegen();
-};
+  using NodeIdx = uint32_t;
+  static constexpr NodeIdx NoNode = ~0u;
 
-}  // end anonymous namespace
+  using NodeKind = ExprKind;
 
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
-
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
-
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
+  struct Node {
+    NodeKind Kind;
+    char Op;
+    uint32_t A, B, C;
+  };
 
-  // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0)
-    return -1;
-  return TokPrec;
-}
+private:
+  std::vector<Node> Nodes;
+  std::vector<NodeIdx> Extra;
+  std::vector<double> Consts;
+  NodeIdx Root = NoNode;
 
-/// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
-  return nullptr;
-}
+public:
+  NodeIdx addNode(NodeKind Kind, uint32_t A = 0, uint32_t B = 0,
+                  uint32_t C = 0, char Op = 0) {
+    Nodes.push_back({Kind, Op, A, B, C});
+    return (NodeIdx)Nodes.size() - 1;
+  }
+  NodeIdx addNumber(double Val) {
+    Consts.push_back(Val);
+    return addNode(NodeKind::Number, (uint32_t)Consts.size() - 1);
+  }
+  /// addExtra - Store a run of child indices, returning where it starts.
+  uint32_t addExtra(ArrayRef<NodeIdx> Children) {
+    uint32_t Start = (uint32_t)Extra.size();
+    Extra.insert(Extra.end(), Children.begin(), Children.end());
+    return Start;
+  }
+  void setRoot(NodeIdx N) { Root = N; }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-  LogError(Str);
-  return nullptr;
-}
+  const Node &getNode(NodeIdx N) const { return Nodes[N]; }
+  double getConst(uint32_t I) const { return Consts[I]; }
+  NodeIdx getExtra(uint32_t I) const { return Extra[I]; }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+  size_t getNumNodes() const { return Nodes.size(); }
+  size_t getMemoryUsage() const {
+    return Nodes.capacity() * sizeof(Node) +
+           Extra.capacity() * sizeof(NodeIdx) +
+           Consts.capacity() * sizeof(double);
+  }
 
-/// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken(); // consume the number
-  return std::move(Result);
-}
+  NodeIdx getRoot() const { return Root; }
+  Value *codegen() const;
+};
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // eat (.
-  auto V = ParseExpression();
-  if (!V)
-    return nullptr;
+static_assert(sizeof(FlatAST::Node) == 16, "keep flat nodes compact");
 
-  if (CurTok != ')')
-    return LogError("expected ')'");
-  getNextToken(); // eat ).
-  return V;
-}
+class SharedExprTable;
 
-/// identifierexpr
-///   ::= identifier
-///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+/// FunctionAST - This class represents a function definition itself.  It
+/// owns the arena its body was allocated from, or the body's FlatAST once it
+/// has been flattened.
+class FunctionAST {
+  std::unique_ptr<PrototypeAST> Proto;
+  const ExprAST *Body;
+  std::unique_ptr<ASTArena> Arena;
+  std::unique_ptr<FlatAST> Flat;
 
-  getNextToken(); // eat identifier.
+public:
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, const ExprAST *Body,
+              std::unique_ptr<ASTArena> Arena)
+      : Proto(std::move(Proto)), Body(Body), Arena(std::move(Arena)) {}
+
+  /// codegen - Generate the function, under IRName if one is given.
+  Function *codegen(StringRef IRName = StringRef());
+  SymbolID getName() const { return Proto->getName(); }
+  const PrototypeAST &getProto() const { return *Proto; }
+  const ASTArena &getArena() const { return *Arena; }
+
+  /// simplifyBody - Fold constants and identities in the tree body.
+  void simplifyBody(FoldMode Mode);
+
+  /// shareBody - Replace the pure subtrees of the tree body with the ones
+  /// interned in Table, keeping only the rest in a new arena.
+  void shareBody(SharedExprTable &Table);
+
+  /// flattenBody - Replace the tree body with a FlatAST and free the arena.
+  void flattenBody();
+  const ExprAST *getBody() const { return Body; }
+  const FlatAST *getFlatBody() const { return Flat.get(); }
+
+  /// print - Print the definition in the source syntax.
+  void print(raw_ostream &OS) const;
+  /// hash - A structural hash of the prototype and body, the same whether or
+  /// not the body has been flattened.
+  hash_code hash() const;
+  /// isSameAs - Whether Other has the same prototype and body, compared node
+  /// by node, to confirm that equal hashes aren't a collision.
+  bool isSameAs(const FunctionAST &Other) const;
+};
 
-  if (CurTok != '(') // Simple variable ref.
-    return std::make_unique<VariableExprAST>(IdName);
+/// TreeView/FlatView - Uniform access to the two forms of a function body for
+/// the walks that handle both.  Operands are numbered as in FlatAST; a For
+/// without a step has NoOperand in its place.
+struct TreeView {
+  using NodeRef = const ExprAST *;
+  static constexpr NodeRef NoOperand = nullptr;
+
+  ExprKind getKind(NodeRef N) const { return N->getKind(); }
+  bool isShared(NodeRef N) const { return N->isShared(); }
+  double getNumVal(NodeRef N) const { return cast<NumberExprAST>(N)->getVal(); }
+  char getOp(NodeRef N) const { return cast<BinaryExprAST>(N)->getOp(); }
+
+  /// getSymbol - The variable, callee or loop variable name.
+  SymbolID getSymbol(NodeRef N) const {
+    switch (N->getKind()) {
+    case ExprKind::Variable:
+      return cast<VariableExprAST>(N)->getName();
+    case ExprKind::Call:
+      return cast<CallExprAST>(N)->getCallee();
+    case ExprKind::For:
+      return cast<ForExprAST>(N)->getVarName();
+    default:
+      llvm_unreachable("node has no symbol");
+    }
+  }
 
-  // Call.
-  getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
-    while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
-      else
-        return nullptr;
+  unsigned getNumOperands(NodeRef N) const {
+    switch (N->getKind()) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      return 0;
+    case ExprKind::Binary:
+      return 2;
+    case ExprKind::Call:
+      return cast<CallExprAST>(N)->getArgs().size();
+    case ExprKind::If:
+      return 3;
+    case ExprKind::For:
+      return 4;
+    }
+    llvm_unreachable("unknown expression kind");
+  }
 
-      if (CurTok == ')')
-        break;
+  NodeRef getOperand(NodeRef N, unsigned I) const {
+    switch (N->getKind()) {
+    case ExprKind::Binary: {
+      auto *B = cast<BinaryExprAST>(N);
+      return I == 0 ? B->getLHS() : B->getRHS();
+    }
+    case ExprKind::Call:
+      return cast<CallExprAST>(N)->getArgs()[I];
+    case ExprKind::If: {
+      auto *If = cast<IfExprAST>(N);
+      const ExprAST *Ops[] = {If->getCond(), If->getThen(), If->getElse()};
+      return Ops[I];
+    }
+    case ExprKind::For: {
+      auto *For = cast<ForExprAST>(N);
+      const ExprAST *Ops[] = {For->getStart(), For->getEnd(),
+                              For->getStep(), For->getBody()};
+      return Ops[I];
+    }
+    default:
+      llvm_unreachable("node has no operands");
+    }
+  }
+};
 
-      if (CurTok != ',')
-        return LogError("Expected ')' or ',' in argument list");
-      getNextToken();
+struct FlatView {
+  using NodeRef = FlatAST::NodeIdx;
+  static constexpr NodeRef NoOperand = FlatAST::NoNode;
+
+  const FlatAST &F;
+
+  ExprKind getKind(NodeRef N) const { return F.getNode(N).Kind; }
+  bool isShared(NodeRef) const { return false; }
+  double getNumVal(NodeRef N) const { return F.getConst(F.getNode(N).A); }
+  char getOp(NodeRef N) const { return F.getNode(N).Op; }
+  SymbolID getSymbol(NodeRef N) const { return F.getNode(N).A; }
+
+  unsigned getNumOperands(NodeRef N) const {
+    const FlatAST::Node &Nd = F.getNode(N);
+    switch (Nd.Kind) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      return 0;
+    case ExprKind::Binary:
+      return 2;
+    case ExprKind::Call:
+      return Nd.C;
+    case ExprKind::If:
+      return 3;
+    case ExprKind::For:
+      return 4;
     }
+    llvm_unreachable("unknown expression kind");
   }
 
-  // Eat the ')'.
-  getNextToken();
+  NodeRef getOperand(NodeRef N, unsigned I) const {
+    const FlatAST::Node &Nd = F.getNode(N);
+    switch (Nd.Kind) {
+    case ExprKind::Binary:
+    case ExprKind::If:
+      return I == 0 ? Nd.A : I == 1 ? Nd.B : Nd.C;
+    case ExprKind::Call:
+    case ExprKind::For:
+      return F.getExtra(Nd.B + I);
+    default:
+      llvm_unreachable("node has no operands");
+    }
+  }
+};
 
-  return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+/// ExprWalker - Base class for the passes that compute a result for each node
+/// from the results of its operands: folding, sharing, flattening, printing
+/// and hashing.  Derived provides
+///   ResultT visitNumber(NodeRef N);
+///   ResultT visitVariable(NodeRef N);
+///   ResultT visitBinary(NodeRef N, ArrayRef<ResultT> Ops);  (and likewise
+///   visitCall, visitIf and visitFor)
+/// and may override visitMissing, for a For without a step, and
+/// beforeOperand, called on the way down to each operand.  The calls are
+/// resolved statically and inline into the walk, which keeps its own stack
+/// so that no expression is too deep for it.
+///
+/// Codegen, the interpreter and the bytecode compiler don't use it: they do
+/// work between operands (branches, loop blocks), and keep their own walks
+/// over the same views.
+template <typename Derived, typename ViewT, typename ResultT>
+class ExprWalker {
+public:
+  using NodeRef = typename ViewT::NodeRef;
 
-/// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
-  getNextToken(); // eat the if.
+protected:
+  ViewT View;
 
-  // condition.
-  auto Cond = ParseExpression();
-  if (!Cond)
-    return nullptr;
+  ExprWalker(ViewT View) : View(View) {}
 
-  if (CurTok!= tok_then)
-    return LogError("expected 'then'");
-  getNextToken(); // eat the then.
+public:
+  ResultT visitMissing() { return ResultT(); }
+  void beforeOperand(NodeRef, unsigned) {}
 
-  auto Then = ParseExpression();
-  if (!Then)
-    return nullptr;
-    
-  if (CurTok!= tok_else)
-    return LogError("expected 'else'");
-  getNextToken(); // eat the else.
+  /// walk - Visit the expression rooted at Root in post-order and return the
+  /// result for Root.
+  ResultT walk(NodeRef Root);
+};
 
-  auto Else = ParseExpression();
-  if (!Else)
-    return nullptr;
+template <typename Derived, typename ViewT, typename ResultT>
+ResultT ExprWalker<Derived, ViewT, ResultT>::walk(NodeRef Root) {
+  Derived &D = static_cast<Derived &>(*this);
+
+  // Each frame is a node and how many of its operands have been visited.
+  // The results of visited operands wait on Done until their parent is
+  // visited.
+  struct Frame {
+    NodeRef N;
+    unsigned NextOp;
+  };
+  SmallVector<Frame, 32> Stack = {{Root, 0}};
+  SmallVector<ResultT, 32> Done;
+  while (!Stack.empty()) {
+    Frame &Fr = Stack.back();
+    NodeRef N = Fr.N;
+    unsigned NumOps = View.getNumOperands(N);
+    if (Fr.NextOp != NumOps) {
+      unsigned I = Fr.NextOp++;
+      D.beforeOperand(N, I);
+      NodeRef Op = View.getOperand(N, I);
+      if (Op != ViewT::NoOperand)
+        Stack.push_back({Op, 0});
+      else
+        Done.push_back(D.visitMissing());
+      continue;
+    }
 
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                      std::move(Else));
+    ArrayRef<ResultT> Ops = ArrayRef<ResultT>(Done).take_back(NumOps);
+    ResultT Result;
+    switch (View.getKind(N)) {
+    case ExprKind::Number:
+      Result = D.visitNumber(N);
+      break;
+    case ExprKind::Variable:
+      Result = D.visitVariable(N);
+      break;
+    case ExprKind::Binary:
+      Result = D.visitBinary(N, Ops);
+      break;
+    case ExprKind::Call:
+      Result = D.visitCall(N, Ops);
+      break;
+    case ExprKind::If:
+      Result = D.visitIf(N, Ops);
+      break;
+    case ExprKind::For:
+      Result = D.visitFor(N, Ops);
+      break;
+    }
+    Done.resize(Done.size() - NumOps);
+    Done.push_back(Result);
+    Stack.pop_back();
+  }
+  return Done.back();
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
-  getNextToken(); // eat the for.
-
-  if (CurTok != tok_identifier)
-    return LogError("expected identifier after 'for'");
-
-  std::string IdName = IdentifierStr;
-  getNextToken(); // eat identifier.
-
-  if (CurTok != '=')
-    return LogError("expected '='");
-  getNextToken(); // eat '='
+/// Flattener - Appends a tree to a FlatAST in post-order.
+class Flattener : public ExprWalker<Flattener, TreeView, FlatAST::NodeIdx> {
+  using NodeIdx = FlatAST::NodeIdx;
+  FlatAST &F;
 
-  auto Start = ParseExpression();
-  if (!Start)
-    return nullptr;
-  if(CurTok != ',')
-    return LogError("expected ',' after for start value");
-  getNextToken(); // eat ','
-  
-  auto End = ParseExpression();
-  if (!End)
-    return nullptr;
+public:
+  Flattener(FlatAST &F) : ExprWalker(TreeView()), F(F) {}
 
-  // 未必有步长
-  std::unique_ptr<ExprAST> Step;
-  if (CurTok == ',') {
-    getNextToken(); // eat the ','.
-    Step = ParseExpression();
-    if (!Step)
-      return nullptr;
+  NodeIdx visitMissing() { return FlatAST::NoNode; }
+  NodeIdx visitNumber(NodeRef E) { return F.addNumber(View.getNumVal(E)); }
+  NodeIdx visitVariable(NodeRef E) {
+    return F.addNode(ExprKind::Variable, View.getSymbol(E));
+  }
+  NodeIdx visitBinary(NodeRef E, ArrayRef<NodeIdx> Ops) {
+    return F.addNode(ExprKind::Binary, Ops[0], Ops[1], 0, View.getOp(E));
   }
+  NodeIdx visitCall(NodeRef E, ArrayRef<NodeIdx> Ops) {
+    return F.addNode(ExprKind::Call, View.getSymbol(E), F.addExtra(Ops),
+                     Ops.size());
+  }
+  NodeIdx visitIf(NodeRef, ArrayRef<NodeIdx> Ops) {
+    return F.addNode(ExprKind::If, Ops[0], Ops[1], Ops[2]);
+  }
+  NodeIdx visitFor(NodeRef E, ArrayRef<NodeIdx> Ops) {
+    return F.addNode(ExprKind::For, View.getSymbol(E), F.addExtra(Ops));
+  }
+};
 
-  if (CurTok != tok_in)
-    return LogError("expected 'in'");
-  getNextToken(); // eat the 'in'.
+} // end anonymous namespace
 
-  auto Body = ParseExpression();
-  if (!Body) 
-    return nullptr;
-  
-  return std::make_unique<ForExprAST>(IdName, std::move(Start),
-                                      std::move(End), std::move(Step),
-                                      std::move(Body));
+/// flattenExpr - Append the tree rooted at Root to F in post-order and return
+/// the index of its root.
+static FlatAST::NodeIdx flattenExpr(const ExprAST *Root, FlatAST &F) {
+  return Flattener(F).walk(Root);
 }
 
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-///   ::= ifexpr
-///   ::= forexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
-  default:
-    return LogError("unknown token when expecting an expression");
-  case tok_identifier:
-    return ParseIdentifierExpr();
-  case tok_number:
-    return ParseNumberExpr();
-  case '(':
-    return ParseParenExpr();
-  case tok_if:
-    return ParseIfExpr();
-  case tok_for:
-    return ParseForExpr();
-  }
-}
-
-// binoprhs
-///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-  // If this is a binop, find its precedence.
-  while (true) {
-    int TokPrec = GetTokPrecedence();
+/// evalBinary - Fold Op applied to two constants, as the generated code would
+/// compute it.  Returns false for an unknown operator.
+static bool evalBinary(char Op, double L, double R, double &Result) {
+  switch (Op) {
+  case '+':
+    Result = L + R;
+    return true;
+  case '-':
+    Result = L - R;
+    return true;
+  case '*':
+    Result = L * R;
+    return true;
+  case '<':
+    // An unordered-or-less-than comparison, so NaN compares true.
+    Result = !(L >= R);
+    return true;
+  default:
+    return false;
+  }
+}
 
-    // If this is a binop that binds at least as tightly as the current binop,
-    // consume it, otherwise we are done.
-    if (TokPrec < ExprPrec)
-      return LHS;
+namespace {
 
-    // Okay, we know this is a binop.
-    int BinOp = CurTok;
-    getNextToken(); // eat binop
+/// Simplified - A simplified subtree, and whether it contains a call (or a
+/// loop), which makes it unsafe to drop.
+struct Simplified {
+  const ExprAST *E;
+  bool HasEffects;
+};
 
-    // Parse the primary expression after the binary operator.
-    auto RHS = ParsePrimary();
-    if (!RHS)
-      return nullptr;
+} // end anonymous namespace
+
+/// simplifyBinary - Simplify Op applied to already simplified operands.
+/// Returns a null E if nothing applies.
+static Simplified simplifyBinary(char Op, Simplified L, Simplified R,
+                                 FoldMode Mode, ASTArena &A) {
+  auto *LC = dyn_cast<NumberExprAST>(L.E);
+  auto *RC = dyn_cast<NumberExprAST>(R.E);
+  auto IsConst = [](const NumberExprAST *C, double Val) {
+    return C && C->getVal() == Val &&
+           std::signbit(C->getVal()) == std::signbit(Val);
+  };
+  double Val;
+  if (LC && RC && evalBinary(Op, LC->getVal(), RC->getVal(), Val))
+    return {A.make<NumberExprAST>(Val), false};
+
+  // Identities that hold for every double, NaNs and signed zeros included.
+  if (Op == '*' && IsConst(RC, 1.0))
+    return L;
+  if (Op == '*' && IsConst(LC, 1.0))
+    return R;
+  if (Op == '+' && IsConst(RC, -0.0))
+    return L;
+  if (Op == '+' && IsConst(LC, -0.0))
+    return R;
+  if (Op == '-' && IsConst(RC, 0.0))
+    return L;
+  if (Mode != FoldMode::Fast)
+    return {nullptr, false};
+
+  // Put the constant of a commutative operator on the right, so that
+  // "1 + x + 2" becomes "(x + 1) + 2" and then "x + 3".
+  bool Swapped = (Op == '+' || Op == '*') && LC && !RC;
+  if (Swapped) {
+    std::swap(L, R);
+    std::swap(LC, RC);
+  }
+  if (RC && RC->getVal() == 0.0) {
+    if (Op == '+' || Op == '-')
+      return L;
+    if (Op == '*' && !L.HasEffects)
+      return {A.make<NumberExprAST>(0.0), false};
+  }
+  auto *LV = dyn_cast<VariableExprAST>(L.E);
+  auto *RV = dyn_cast<VariableExprAST>(R.E);
+  if ((Op == '-' || Op == '<') && LV && RV && LV->getName() == RV->getName())
+    return {A.make<NumberExprAST>(0.0), false};
+
+  // Reassociate (x op c1) op c2 into x op (c1 op c2).
+  auto *LB = dyn_cast<BinaryExprAST>(L.E);
+  if ((Op == '+' || Op == '*') && RC && LB && LB->getOp() == Op)
+    if (auto *C1 = dyn_cast<NumberExprAST>(LB->getRHS()))
+      if (evalBinary(Op, C1->getVal(), RC->getVal(), Val))
+        return {A.make<BinaryExprAST>(Op, LB->getLHS(),
+                                      A.make<NumberExprAST>(Val)),
+                L.HasEffects};
+  if (Swapped)
+    return {A.make<BinaryExprAST>(Op, L.E, R.E), L.HasEffects};
+  return {nullptr, false};
+}
 
-    // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
-    int NextPrec = GetTokPrecedence();
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-      if (!RHS)
-        return nullptr;
+namespace {
+
+/// Simplifier - The walk behind simplifyExpr.
+class Simplifier : public ExprWalker<Simplifier, TreeView, Simplified> {
+  ASTArena &A;
+  FoldMode Mode;
+
+  /// rebuild - Whether E's operands changed, and whether any has effects.
+  bool rebuild(NodeRef E, ArrayRef<Simplified> Ops, bool &HasEffects) {
+    bool Changed = false;
+    HasEffects = false;
+    for (unsigned I = 0; I != Ops.size(); ++I) {
+      Changed |= Ops[I].E != View.getOperand(E, I);
+      HasEffects |= Ops[I].HasEffects;
+    }
+    return Changed;
+  }
+
+public:
+  Simplifier(ASTArena &A, FoldMode Mode)
+      : ExprWalker(TreeView()), A(A), Mode(Mode) {}
+
+  Simplified visitMissing() { return {nullptr, false}; }
+  Simplified visitNumber(NodeRef E) { return {E, false}; }
+  Simplified visitVariable(NodeRef E) { return {E, false}; }
+
+  Simplified visitBinary(NodeRef E, ArrayRef<Simplified> Ops) {
+    bool HasEffects;
+    bool Changed = rebuild(E, Ops, HasEffects);
+    char Op = View.getOp(E);
+    Simplified Result = simplifyBinary(Op, Ops[0], Ops[1], Mode, A);
+    if (!Result.E)
+      Result = {Changed ? A.make<BinaryExprAST>(Op, Ops[0].E, Ops[1].E) : E,
+                HasEffects};
+    return Result;
+  }
+
+  Simplified visitCall(NodeRef E, ArrayRef<Simplified> Ops) {
+    bool HasEffects;
+    if (!rebuild(E, Ops, HasEffects))
+      return {E, true};
+    SmallVector<const ExprAST *, 8> Args;
+    for (const Simplified &Arg : Ops)
+      Args.push_back(Arg.E);
+    return {A.make<CallExprAST>(View.getSymbol(E),
+                                A.copyArray(ArrayRef<const ExprAST *>(Args))),
+            true};
+  }
+
+  Simplified visitIf(NodeRef E, ArrayRef<Simplified> Ops) {
+    bool HasEffects;
+    bool Changed = rebuild(E, Ops, HasEffects);
+    // Matches the 'one' comparison codegen uses: NaN takes the else branch.
+    if (auto *C = dyn_cast<NumberExprAST>(Ops[0].E))
+      return C->getVal() != 0.0 && !std::isnan(C->getVal()) ? Ops[1] : Ops[2];
+    if (Changed)
+      return {A.make<IfExprAST>(Ops[0].E, Ops[1].E, Ops[2].E), HasEffects};
+    return {E, HasEffects};
+  }
+
+  Simplified visitFor(NodeRef E, ArrayRef<Simplified> Ops) {
+    bool HasEffects;
+    if (!rebuild(E, Ops, HasEffects))
+      return {E, true};
+    return {A.make<ForExprAST>(View.getSymbol(E), Ops[0].E, Ops[1].E,
+                               Ops[2].E, Ops[3].E),
+            true};
+  }
+};
+
+} // end anonymous namespace
+
+/// simplifyExpr - Fold constant subexpressions, constant if conditions and
+/// algebraic identities in the tree rooted at Root, in post-order.  New nodes
+/// are allocated in A; subtrees that don't change are shared with the
+/// original.
+static const ExprAST *simplifyExpr(const ExprAST *Root, ASTArena &A,
+                                   FoldMode Mode) {
+  return Simplifier(A, Mode).walk(Root).E;
+}
+
+namespace {
+
+/// SharedExprTable - Hash-consing of pure subexpressions: numbers, variables,
+/// and the binary operators and ifs built only from them.  Structurally equal
+/// pure subtrees, within one function or across any number of them, become a
+/// single node that the table owns for the life of the program and marks as
+/// shared.  Children are interned first, so two nodes are equal when their
+/// fields are and their children are the same pointers.  Interning is
+/// thread-safe, for the definitions parsed by -parse-jobs.
+class SharedExprTable {
+  struct Key {
+    ExprKind Kind;
+    char Op;
+    uint64_t Val; // The number's bits or the variable's SymbolID
+    const ExprAST *A, *B, *C;
+
+    bool operator==(const Key &K) const {
+      return Kind == K.Kind && Op == K.Op && Val == K.Val && A == K.A &&
+             B == K.B && C == K.C;
+    }
+  };
+  struct KeyInfo {
+    static Key getEmptyKey() { return {ExprKind::Call, 0, 0, {}, {}, {}}; }
+    static Key getTombstoneKey() { return {ExprKind::For, 0, 0, {}, {}, {}}; }
+    static unsigned getHashValue(const Key &K) {
+      return hash_combine(K.Kind, K.Op, K.Val, K.A, K.B, K.C);
     }
+    static bool isEqual(const Key &L, const Key &R) { return L == R; }
+  };
+
+  std::mutex Lock;
+  ASTArena Nodes;
+  DenseMap<Key, const ExprAST *, KeyInfo> Table;
+  size_t NumLookups = 0;
+
+  /// Shared - A node after sharing, and whether its subtree is pure.
+  struct Shared {
+    const ExprAST *E;
+    bool Pure;
+  };
+  class Sharer;
+
+  template <typename NodeT, typename... ArgTs>
+  const ExprAST *intern(const Key &K, ArgTs &&...Args) {
+    ++NumLookups;
+    const ExprAST *&Slot = Table[K];
+    if (!Slot) {
+      NodeT *N = Nodes.make<NodeT>(std::forward<ArgTs>(Args)...);
+      N->Shared = true;
+      Slot = N;
+    }
+    return Slot;
+  }
+
+public:
+  /// share - Rebuild the tree rooted at Root with its pure subtrees interned.
+  /// Calls and loops, and the nodes above them, stay unshared and are copied
+  /// into A, so nothing in the result refers to Root's arena.
+  const ExprAST *share(const ExprAST *Root, ASTArena &A);
+
+  /// getNumNodes - The distinct pure subexpressions seen.
+  size_t getNumNodes() const { return Table.size(); }
+  /// getNumLookups - The pure nodes interned, duplicates included.
+  size_t getNumLookups() const { return NumLookups; }
+  size_t getBytesAllocated() const {
+    return Nodes.getBytesAllocated() + Table.getMemorySize();
+  }
+};
+
+} // end anonymous namespace
+
+/// Sharer - The walk behind share.
+class SharedExprTable::Sharer : public ExprWalker<Sharer, TreeView, Shared> {
+  SharedExprTable &T;
+  ASTArena &A;
+
+  static bool allPure(ArrayRef<Shared> Ops) {
+    return llvm::all_of(Ops, [](const Shared &Op) { return Op.Pure; });
+  }
+
+public:
+  Sharer(SharedExprTable &T, ASTArena &A)
+      : ExprWalker(TreeView()), T(T), A(A) {}
+
+  Shared visitMissing() { return {nullptr, true}; }
+
+  Shared visitNumber(NodeRef E) {
+    double Val = View.getNumVal(E);
+    Key K = {ExprKind::Number, 0, bit_cast<uint64_t>(Val), {}, {}, {}};
+    return {T.intern<NumberExprAST>(K, Val), true};
+  }
+
+  Shared visitVariable(NodeRef E) {
+    SymbolID Name = View.getSymbol(E);
+    Key K = {ExprKind::Variable, 0, Name, {}, {}, {}};
+    return {T.intern<VariableExprAST>(K, Name), true};
+  }
+
+  Shared visitBinary(NodeRef E, ArrayRef<Shared> Ops) {
+    char Op = View.getOp(E);
+    if (allPure(Ops))
+      return {T.intern<BinaryExprAST>(
+                  {ExprKind::Binary, Op, 0, Ops[0].E, Ops[1].E, {}}, Op,
+                  Ops[0].E, Ops[1].E),
+              true};
+    return {A.make<BinaryExprAST>(Op, Ops[0].E, Ops[1].E), false};
+  }
+
+  Shared visitCall(NodeRef E, ArrayRef<Shared> Ops) {
+    SmallVector<const ExprAST *, 8> Args;
+    for (const Shared &Arg : Ops)
+      Args.push_back(Arg.E);
+    return {A.make<CallExprAST>(View.getSymbol(E),
+                                A.copyArray(ArrayRef<const ExprAST *>(Args))),
+            false};
+  }
+
+  Shared visitIf(NodeRef, ArrayRef<Shared> Ops) {
+    if (allPure(Ops))
+      return {T.intern<IfExprAST>(
+                  {ExprKind::If, 0, 0, Ops[0].E, Ops[1].E, Ops[2].E},
+                  Ops[0].E, Ops[1].E, Ops[2].E),
+              true};
+    return {A.make<IfExprAST>(Ops[0].E, Ops[1].E, Ops[2].E), false};
+  }
+
+  Shared visitFor(NodeRef E, ArrayRef<Shared> Ops) {
+    return {A.make<ForExprAST>(View.getSymbol(E), Ops[0].E, Ops[1].E,
+                               Ops[2].E, Ops[3].E),
+            false};
+  }
+};
 
-    // Merge LHS/RHS.
-    LHS =
-        std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+const ExprAST *SharedExprTable::share(const ExprAST *Root, ASTArena &A) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  return Sharer(*this, A).walk(Root).E;
+}
+
+void FunctionAST::simplifyBody(FoldMode Mode) {
+  if (Mode != FoldMode::None)
+    Body = simplifyExpr(Body, *Arena, Mode);
+}
+
+void FunctionAST::shareBody(SharedExprTable &Table) {
+  auto Spine = std::make_unique<ASTArena>();
+  Body = Table.share(Body, *Spine);
+  Arena = std::move(Spine);
+}
+
+void FunctionAST::flattenBody() {
+  Flat = std::make_unique<FlatAST>();
+  Flat->setRoot(flattenExpr(Body, *Flat));
+  Body = nullptr;
+  Arena.reset();
+}
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// Parser - A recursive descent parser over the tokens of a Lexer, or of a
+/// TokenBuffer lexed in advance.  The current token and the operator
+/// precedence table belong to the parser, so any number of them can run at
+/// once.
+class Parser {
+  Lexer *Lex = nullptr;
+  const TokenBuffer *Toks = nullptr;
+  size_t NextTok = 0; // Index in Toks of the token after CurTok
+
+  /// CurTok - The current token the parser is looking at.
+  int CurTok = 0;
+
+  /// Arena - Where the nodes of the item being parsed are allocated.  Each
+  /// definition or top-level expression gets a fresh one.
+  std::unique_ptr<ASTArena> Arena;
+
+  /// BinopPrecedence - This holds the precedence for each binary operator that
+  /// is defined.  The standard binary operators are installed up front; 1 is
+  /// the lowest precedence.
+  std::map<char, int> BinopPrecedence = {
+      {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}};
+
+  /// getIdentifier/getNumVal - The value of CurTok, if it is tok_identifier or
+  /// tok_number respectively.
+  SymbolID getIdentifier() const {
+    return Toks ? Toks->getSymbol(NextTok - 1) : Lex->getIdentifierSym();
+  }
+  double getNumVal() const {
+    return Toks ? Toks->getNumVal(NextTok - 1) : Lex->getNumVal();
+  }
+
+  int GetTokPrecedence();
+
+  ExprAST *ParseExpression();
+  std::unique_ptr<PrototypeAST> ParsePrototype();
+
+  /// advance - Move to the next token in the buffer.  With Report, that
+  /// includes reporting the error the lexer found in it, if any, as lexing
+  /// it now would have.
+  int advance(bool Report);
+
+public:
+  explicit Parser(Lexer &Lex) : Lex(&Lex) {}
+  explicit Parser(const TokenBuffer &Toks) : Toks(&Toks) {}
+
+  int getCurTok() const { return CurTok; }
+
+  /// getNextToken - Read another token and update CurTok with its results.
+  /// A token buffer is never read past its trailing tok_eof.
+  int getNextToken() {
+    if (!Toks)
+      return CurTok = Lex->gettok();
+    return advance(/*Report=*/true);
+  }
+
+  /// peekToken - The token Ahead places after CurTok.  Only available when
+  /// parsing from a TokenBuffer.
+  int peekToken(unsigned Ahead = 1) const {
+    assert(Toks && "lookahead needs a token buffer");
+    return Toks->getKind(std::min(NextTok - 1 + Ahead, Toks->size() - 1));
+  }
+
+  /// getTokenIndex/seekToken - Save and restore the position in the token
+  /// buffer, for backtracking or for starting at an arbitrary token.  A
+  /// parser that seeks to a token hasn't reached it by parsing, so whoever
+  /// did has already reported its error.
+  size_t getTokenIndex() const {
+    assert(Toks && "positions need a token buffer");
+    return NextTok - 1;
+  }
+  void seekToken(size_t Idx) {
+    assert(Toks && "positions need a token buffer");
+    NextTok = Idx;
+    advance(/*Report=*/false);
   }
+
+  std::unique_ptr<FunctionAST> ParseDefinition();
+  std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+  std::unique_ptr<PrototypeAST> ParseExtern();
+};
+
+} // end anonymous namespace
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+int Parser::GetTokPrecedence() {
+  if (!isascii(CurTok))
+    return -1;
+
+  // Make sure it's a declared binop.
+  int TokPrec = BinopPrecedence[CurTok];
+  if (TokPrec <= 0)
+    return -1;
+  return TokPrec;
+}
+
+/// DeferredErrors - When set, errors on this thread are collected here rather
+/// than printed, so that work done out of order can report them in order.
+static thread_local std::string *DeferredErrors = nullptr;
+
+/// LogError* - These are little helper functions for error handling.
+ExprAST *LogError(const char *Str) {
+  if (DeferredErrors)
+    (*DeferredErrors += "Error: ") += std::string(Str) + "\n";
+  else
+    fprintf(stderr, "Error: %s\n", Str);
+  return nullptr;
+}
+
+int Parser::advance(bool Report) {
+  size_t Idx = std::min(NextTok, Toks->size() - 1);
+  // The trailing tok_eof may be read any number of times, but reached once.
+  if (Report && NextTok < Toks->size())
+    if (const std::string *Diag = Toks->getDiagnostic(Idx))
+      LogError(Diag->c_str());
+  NextTok = Idx + 1;
+  return CurTok = Toks->getKind(Idx);
+}
+
+std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+  LogError(Str);
+  return nullptr;
 }
 
-// expression
-///   ::= primary binoprhs
+/// expression
+///   ::= primary (binop primary)*
+/// primary
+///   ::= identifier
+///   ::= identifier '(' (expression (',' expression)*)? ')'
+///   ::= number
+///   ::= '(' expression ')'
+///   ::= 'if' expression 'then' expression 'else' expression
+///   ::= 'for' identifier '=' expression ',' expression (',' expression)?
+///         'in' expression
 ///
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParsePrimary();
-  if (!LHS)
-    return nullptr;
+/// The parser keeps its state on explicit stacks rather than recursing, so
+/// the nesting depth of an expression is limited only by memory.  Each
+/// unfinished construct that contains subexpressions (parentheses, call
+/// arguments, and the parts of if and for) is a Context.  Within a context,
+/// binary operators are resolved by operator precedence: an operator waits on
+/// the operator stack until one that binds no tighter arrives, which gives the
+/// same left-associative trees as precedence climbing.
+ExprAST *Parser::ParseExpression() {
+  enum ContextKind {
+    TopLevel, Paren, CallArg,
+    IfCond, IfThen, IfElse,
+    ForStart, ForEnd, ForStep, ForBody
+  };
+  struct Context {
+    ContextKind Kind;
+    unsigned OperatorBase; // Operators below this belong to outer contexts
+    unsigned OperandBase;  // Where a call's arguments start
+    SymbolID Name;         // Callee or loop variable
+  };
+  SmallVector<Context, 16> Contexts;
+  SmallVector<ExprAST *, 32> Operands;
+  SmallVector<std::pair<char, int>, 16> Operators;
+
+  auto PushContext = [&](ContextKind Kind, SymbolID Name = 0) {
+    Contexts.push_back({Kind, (unsigned)Operators.size(),
+                        (unsigned)Operands.size(), Name});
+  };
+  auto PopOperand = [&] { return Operands.pop_back_val(); };
+  // Apply the pending operators of the current context that bind at least as
+  // tightly as Prec.
+  auto Reduce = [&](int Prec) {
+    while (Operators.size() > Contexts.back().OperatorBase &&
+           Operators.back().second >= Prec) {
+      char Op = Operators.pop_back_val().first;
+      ExprAST *RHS = PopOperand();
+      ExprAST *LHS = PopOperand();
+      Operands.push_back(Arena->make<BinaryExprAST>(Op, LHS, RHS));
+    }
+  };
+
+  PushContext(TopLevel);
+  while (true) {
+    // Parse a primary, or open the context of one with subexpressions.
+    switch (CurTok) {
+    default:
+      return LogError("unknown token when expecting an expression");
+    case tok_error:
+      return nullptr; // The lexer has already reported it.
+    case tok_number:
+      Operands.push_back(Arena->make<NumberExprAST>(getNumVal()));
+      getNextToken(); // consume the number
+      break;
+    case tok_identifier: {
+      SymbolID IdName = getIdentifier();
+      getNextToken(); // eat identifier.
+      if (CurTok != '(') { // Simple variable ref.
+        Operands.push_back(Arena->make<VariableExprAST>(IdName));
+        break;
+      }
+      getNextToken(); // eat (
+      if (CurTok == ')') {
+        getNextToken(); // eat ).
+        Operands.push_back(
+            Arena->make<CallExprAST>(IdName, ArrayRef<const ExprAST *>()));
+        break;
+      }
+      PushContext(CallArg, IdName);
+      continue;
+    }
+    case '(':
+      getNextToken(); // eat (.
+      PushContext(Paren);
+      continue;
+    case tok_if:
+      getNextToken(); // eat the if.
+      PushContext(IfCond);
+      continue;
+    case tok_for: {
+      getNextToken(); // eat the for.
+      if (CurTok != tok_identifier)
+        return LogError("expected identifier after 'for'");
+      SymbolID IdName = getIdentifier();
+      getNextToken(); // eat identifier.
+      if (CurTok != '=')
+        return LogError("expected '='");
+      getNextToken(); // eat '='
+      PushContext(ForStart, IdName);
+      continue;
+    }
+    }
 
-  return ParseBinOpRHS(0, std::move(LHS));
+    // After an operand: either a binary operator continues the current
+    // expression, or the expression is complete and its context decides what
+    // comes next.  Completing a context leaves its value as an operand of the
+    // enclosing one.
+    while (true) {
+      int TokPrec = GetTokPrecedence();
+      if (TokPrec > 0) {
+        Reduce(TokPrec);
+        Operators.push_back({(char)CurTok, TokPrec});
+        getNextToken(); // eat binop
+        break;
+      }
+
+      Reduce(0);
+      Context &C = Contexts.back();
+      switch (C.Kind) {
+      case TopLevel:
+        return PopOperand();
+      case Paren:
+        if (CurTok != ')')
+          return LogError("expected ')'");
+        getNextToken(); // eat ).
+        Contexts.pop_back();
+        continue;
+      case CallArg: {
+        if (CurTok == ',') {
+          getNextToken();
+          break;
+        }
+        if (CurTok != ')')
+          return LogError("Expected ')' or ',' in argument list");
+        getNextToken(); // eat the ')'.
+        ArrayRef<ExprAST *> Args =
+            ArrayRef<ExprAST *>(Operands).drop_front(C.OperandBase);
+        auto *Call = Arena->make<CallExprAST>(C.Name, Arena->copyArray(Args));
+        Operands.resize(C.OperandBase);
+        Operands.push_back(Call);
+        Contexts.pop_back();
+        continue;
+      }
+      case IfCond:
+        if (CurTok != tok_then)
+          return LogError("expected 'then'");
+        getNextToken(); // eat the then.
+        C.Kind = IfThen;
+        break;
+      case IfThen:
+        if (CurTok != tok_else)
+          return LogError("expected 'else'");
+        getNextToken(); // eat the else.
+        C.Kind = IfElse;
+        break;
+      case IfElse: {
+        ExprAST *Else = PopOperand();
+        ExprAST *Then = PopOperand();
+        ExprAST *Cond = PopOperand();
+        Operands.push_back(Arena->make<IfExprAST>(Cond, Then, Else));
+        Contexts.pop_back();
+        continue;
+      }
+      case ForStart:
+        if (CurTok != ',')
+          return LogError("expected ',' after for start value");
+        getNextToken(); // eat ','
+        C.Kind = ForEnd;
+        break;
+      case ForEnd:
+        // 未必有步长
+        if (CurTok == ',') {
+          getNextToken(); // eat the ','.
+          C.Kind = ForStep;
+          break;
+        }
+        Operands.push_back(nullptr); // No step.
+        [[fallthrough]];
+      case ForStep:
+        if (CurTok != tok_in)
+          return LogError("expected 'in'");
+        getNextToken(); // eat the 'in'.
+        C.Kind = ForBody;
+        break;
+      case ForBody: {
+        ExprAST *Body = PopOperand();
+        ExprAST *Step = PopOperand();
+        ExprAST *End = PopOperand();
+        ExprAST *Start = PopOperand();
+        Operands.push_back(
+            Arena->make<ForExprAST>(C.Name, Start, End, Step, Body));
+        Contexts.pop_back();
+        continue;
+      }
+      }
+      break; // The context wants another expression.
+    }
+  }
 }
 
 /// prototype
 ///   ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   if (CurTok != tok_identifier)
     return LogErrorP("Expected function name in prototype");
 
-  std::string FnName = IdentifierStr;
+  SymbolID FnName = getIdentifier();
   getNextToken();
 
   if (CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
+  std::vector<SymbolID> ArgNames;
   while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
+    ArgNames.push_back(getIdentifier());
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
@@ -501,28 +1921,33 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
   getNextToken(); // eat def.
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  Arena = std::make_unique<ASTArena>();
+  if (auto *E = ParseExpression())
+    return std::make_unique<FunctionAST>(std::move(Proto), E,
+                                         std::move(Arena));
   return nullptr;
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+  Arena = std::make_unique<ASTArena>();
+  if (auto *E = ParseExpression()) {
     // Make an anonymous proto.
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>()); 
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Proto = std::make_unique<PrototypeAST>(SymbolTable::AnonExprSym,
+                                                std::vector<SymbolID>());
+    return std::make_unique<FunctionAST>(std::move(Proto), E,
+                                         std::move(Arena));
   }
   return nullptr;
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
   getNextToken(); // eat extern.
   return ParsePrototype();
 }
@@ -531,13 +1956,131 @@ static std::unique_ptr<PrototypeAST> ParseExtern() {
 // Code Generation
 //===----------------------------------------------------------------------===//
 
+namespace {
+
+/// ScopedValueTable - The value each name in scope is bound to while a
+/// function is generated.  Binding a name logs what it shadowed, so a scope
+/// is just a position in the log: opening one is free and closing it undoes
+/// the bindings made since, without copying or searching the table.
+class ScopedValueTable {
+  DenseMap<SymbolID, Value *> Bindings;
+  SmallVector<std::pair<SymbolID, Value *>, 16> Undo; // Shadowed, or null
+
+public:
+  Value *lookup(SymbolID Name) const { return Bindings.lookup(Name); }
+  bool isBound(SymbolID Name) const { return Bindings.count(Name); }
+
+  void bind(SymbolID Name, Value *V) {
+    Value *&Slot = Bindings[Name];
+    Undo.push_back({Name, Slot});
+    Slot = V;
+  }
+
+  /// openScope - The scope to pass to closeScope to undo the bindings made
+  /// from now on.
+  size_t openScope() const { return Undo.size(); }
+  void closeScope(size_t Scope) {
+    while (Undo.size() != Scope) {
+      auto [Name, Old] = Undo.pop_back_val();
+      if (Old)
+        Bindings[Name] = Old;
+      else
+        Bindings.erase(Name);
+    }
+  }
+
+  /// clear - Drop every binding, for the next function.
+  void clear() {
+    Bindings.clear();
+    Undo.clear();
+  }
+};
+
+/// PassTimes - For -time-passes, the time spent in each pass and analysis of
+/// the optimizer, over every pipeline it runs.  A pass's time excludes the
+/// passes nested in it; pass managers and adaptors aren't counted.
+class PassTimes {
+  struct Total {
+    double Seconds = 0;
+    unsigned Runs = 0;
+  };
+  StringMap<Total> Totals;
+
+  struct Running {
+    StringRef Name;
+    std::chrono::steady_clock::time_point Start;
+    double Nested;
+  };
+  SmallVector<Running, 8> Stack;
+
+  void start(StringRef Name);
+  void stop(StringRef Name);
+
+public:
+  void registerCallbacks(PassInstrumentationCallbacks &PIC);
+  void print(raw_ostream &OS) const;
+};
+
+/// Optimizer - The new pass manager's pipelines: a function pipeline run on
+/// each function as soon as its IR is generated, and a module pipeline run on
+/// each module as it is handed to the JIT.  -opt-scope picks which of the two
+/// runs the passes that -O or -passes ask for; the other is left empty.
+class Optimizer {
+  PassInstrumentationCallbacks PIC;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  FunctionPassManager FPM;
+  ModulePassManager MPM;
+  ModulePassManager InlineMPM;
+
+public:
+  /// Build the pipelines that the options select.
+  Optimizer();
+
+  /// run - Optimize F, or all of M.  No analysis results are kept afterwards:
+  /// the IR is about to be handed to the JIT.
+  void run(Function &F);
+  void run(Module &M);
+
+  /// inlineImported - Inline the available_externally functions of M where
+  /// the inliner finds it worthwhile, run the function pipeline again on the
+  /// functions they went into, and reduce them to declarations.
+  void inlineImported(Module &M);
+};
+
+/// InlinableDefinitions - For -inline-defs, the optimized IR of each small
+/// definition, kept as bitcode once its module has gone to the JIT.  Every
+/// definition lives in a module of its own, so without these copies a call to
+/// an earlier definition could never be inlined.
+class InlinableDefinitions {
+  StringMap<std::shared_ptr<const std::string>> Bitcode;
+
+public:
+  /// import - Link into M, as available_externally, each kept definition that
+  /// M declares.  Returns whether there were any.
+  bool import(Module &M);
+
+  /// save - Keep the definitions of M that are small enough to be worth
+  /// inlining.  They replace any kept under the same names.
+  void save(const Module &M);
+
+  void forget(StringRef Name) { Bitcode.erase(Name); }
+  void clear() { Bitcode.clear(); }
+};
+
+} // end anonymous namespace
+
 static std::unique_ptr<LLVMContext> TheContext;
 static std::unique_ptr<Module> TheModule;
 static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value *> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static SymbolTable TheSymbols;
+static ScopedValueTable NamedValues;
+static std::unique_ptr<Optimizer> TheOptimizer;
+static InlinableDefinitions SavedDefinitions;
 static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
 static ExitOnError ExitOnErr;
 
 Value *LogErrorV(const char *Str) {
@@ -545,9 +2088,9 @@ Value *LogErrorV(const char *Str) {
   return nullptr;
 }
 
-Function *getFunction(std::string Name) {
+Function *getFunction(SymbolID Name) {
   // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
+  if (auto *F = TheModule->getFunction(TheSymbols.getName(Name)))
     return F;
   
   // If not, check whether we can codegen the declaration from some existing
@@ -560,24 +2103,299 @@ Function *getFunction(std::string Name) {
   return nullptr;
 }
 
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(Val));
+namespace {
+
+/// ExprPrinter - Prints an expression in the source syntax, with every
+/// operator, if and for in parentheses.
+template <typename ViewT>
+class ExprPrinter : public ExprWalker<ExprPrinter<ViewT>, ViewT, bool> {
+  using Base = ExprWalker<ExprPrinter<ViewT>, ViewT, bool>;
+  using typename Base::NodeRef;
+  using Base::View;
+  raw_ostream &OS;
+
+public:
+  ExprPrinter(ViewT View, raw_ostream &OS) : Base(View), OS(OS) {}
+
+  void beforeOperand(NodeRef N, unsigned I) {
+    switch (View.getKind(N)) {
+    case ExprKind::Binary:
+      if (I == 0)
+        OS << '(';
+      else
+        OS << ' ' << View.getOp(N) << ' ';
+      break;
+    case ExprKind::Call:
+      if (I == 0)
+        OS << TheSymbols.getName(View.getSymbol(N)) << '(';
+      else
+        OS << ", ";
+      break;
+    case ExprKind::If: {
+      const char *Words[] = {"(if ", " then ", " else "};
+      OS << Words[I];
+      break;
+    }
+    case ExprKind::For:
+      if (I == 0)
+        OS << "(for " << TheSymbols.getName(View.getSymbol(N)) << " = ";
+      else if (I == 3)
+        OS << " in ";
+      else if (I == 1 || View.getOperand(N, 2) != ViewT::NoOperand)
+        OS << ", ";
+      break;
+    default:
+      break;
+    }
+  }
+
+  bool visitNumber(NodeRef N) {
+    OS << format("%g", View.getNumVal(N));
+    return true;
+  }
+  bool visitVariable(NodeRef N) {
+    OS << TheSymbols.getName(View.getSymbol(N));
+    return true;
+  }
+  bool visitBinary(NodeRef, ArrayRef<bool>) {
+    OS << ')';
+    return true;
+  }
+  bool visitCall(NodeRef N, ArrayRef<bool> Ops) {
+    if (Ops.empty())
+      OS << TheSymbols.getName(View.getSymbol(N)) << '(';
+    OS << ')';
+    return true;
+  }
+  bool visitIf(NodeRef, ArrayRef<bool>) {
+    OS << ')';
+    return true;
+  }
+  bool visitFor(NodeRef, ArrayRef<bool>) {
+    OS << ')';
+    return true;
+  }
+};
+
+/// ExprHasher - A structural hash of an expression.  Symbols hash by ID, so
+/// hashes are only comparable within one run.
+template <typename ViewT>
+class ExprHasher : public ExprWalker<ExprHasher<ViewT>, ViewT, hash_code> {
+  using Base = ExprWalker<ExprHasher<ViewT>, ViewT, hash_code>;
+  using typename Base::NodeRef;
+  using Base::View;
+
+  hash_code hashOperands(NodeRef N, ArrayRef<hash_code> Ops) {
+    return hash_combine(View.getKind(N),
+                        hash_combine_range(Ops.begin(), Ops.end()));
+  }
+
+public:
+  ExprHasher(ViewT View) : Base(View) {}
+
+  hash_code visitMissing() { return hash_value(0); }
+  hash_code visitNumber(NodeRef N) {
+    return hash_combine(ExprKind::Number,
+                        bit_cast<uint64_t>(View.getNumVal(N)));
+  }
+  hash_code visitVariable(NodeRef N) {
+    return hash_combine(ExprKind::Variable, View.getSymbol(N));
+  }
+  hash_code visitBinary(NodeRef N, ArrayRef<hash_code> Ops) {
+    return hash_combine(View.getOp(N), hashOperands(N, Ops));
+  }
+  hash_code visitCall(NodeRef N, ArrayRef<hash_code> Ops) {
+    return hash_combine(View.getSymbol(N), hashOperands(N, Ops));
+  }
+  hash_code visitIf(NodeRef N, ArrayRef<hash_code> Ops) {
+    return hashOperands(N, Ops);
+  }
+  hash_code visitFor(NodeRef N, ArrayRef<hash_code> Ops) {
+    return hash_combine(View.getSymbol(N), hashOperands(N, Ops));
+  }
+};
+
+} // end anonymous namespace
+
+void FunctionAST::print(raw_ostream &OS) const {
+  OS << "def " << TheSymbols.getName(getName()) << '(';
+  interleave(
+      Proto->getArgs(), OS,
+      [&](SymbolID Arg) { OS << TheSymbols.getName(Arg); }, " ");
+  OS << ") ";
+  if (Body)
+    ExprPrinter<TreeView>(TreeView(), OS).walk(Body);
+  else
+    ExprPrinter<FlatView>(FlatView{*Flat}, OS).walk(Flat->getRoot());
+  OS << '\n';
+}
+
+hash_code FunctionAST::hash() const {
+  ArrayRef<SymbolID> Args = Proto->getArgs();
+  hash_code BodyHash =
+      Body ? ExprHasher<TreeView>(TreeView()).walk(Body)
+           : ExprHasher<FlatView>(FlatView{*Flat}).walk(Flat->getRoot());
+  return hash_combine(getName(), hash_combine_range(Args.begin(), Args.end()),
+                      BodyHash);
+}
+
+/// sameExpr - Whether the expressions rooted at A and B, read through VA and
+/// VB, have the same structure, names and constants (compared bitwise, as
+/// ExprHasher hashes them).  Iterative, so that no expression is too deep.
+template <typename ViewA, typename ViewB>
+static bool sameExpr(ViewA VA, typename ViewA::NodeRef A, ViewB VB,
+                     typename ViewB::NodeRef B) {
+  SmallVector<std::pair<typename ViewA::NodeRef, typename ViewB::NodeRef>, 32>
+      Work = {{A, B}};
+  while (!Work.empty()) {
+    auto [NA, NB] = Work.pop_back_val();
+    if ((NA == ViewA::NoOperand) != (NB == ViewB::NoOperand))
+      return false;
+    if (NA == ViewA::NoOperand)
+      continue;
+    ExprKind Kind = VA.getKind(NA);
+    if (Kind != VB.getKind(NB))
+      return false;
+    switch (Kind) {
+    case ExprKind::Number:
+      if (bit_cast<uint64_t>(VA.getNumVal(NA)) !=
+          bit_cast<uint64_t>(VB.getNumVal(NB)))
+        return false;
+      continue;
+    case ExprKind::Binary:
+      if (VA.getOp(NA) != VB.getOp(NB))
+        return false;
+      break;
+    case ExprKind::Variable:
+    case ExprKind::Call:
+    case ExprKind::For:
+      if (VA.getSymbol(NA) != VB.getSymbol(NB))
+        return false;
+      break;
+    case ExprKind::If:
+      break;
+    }
+    unsigned NumOps = VA.getNumOperands(NA);
+    if (NumOps != VB.getNumOperands(NB))
+      return false;
+    for (unsigned I = 0; I != NumOps; ++I)
+      Work.push_back({VA.getOperand(NA, I), VB.getOperand(NB, I)});
+  }
+  return true;
+}
+
+bool FunctionAST::isSameAs(const FunctionAST &Other) const {
+  if (getName() != Other.getName() ||
+      Proto->getArgs() != Other.Proto->getArgs())
+    return false;
+  auto Compare = [&](auto VA, auto RootA) {
+    if (Other.Body)
+      return sameExpr(VA, RootA, TreeView(), Other.Body);
+    return sameExpr(VA, RootA, FlatView{*Other.Flat}, Other.Flat->getRoot());
+  };
+  return Body ? Compare(TreeView(), Body)
+              : Compare(FlatView{*Flat}, Flat->getRoot());
+}
+
+/// TierProfile - While generating tier-0 code, the function's counter of
+/// invocations and loop iterations, and the count at which to promote it.
+struct TierProfile {
+  GlobalVariable *Counter;
+  SymbolID Name;
+  uint64_t Threshold;
+};
+static const TierProfile *CurrentProfile;
+
+/// emitProfileCount - In tier-0 code, count an invocation or a loop iteration
+/// and call the runtime's kaleidoscopeTierUp when the count reaches the
+/// threshold.  Does nothing otherwise.
+static void emitProfileCount() {
+  if (!CurrentProfile)
+    return;
+  Type *Int64Ty = Builder->getInt64Ty();
+  Value *Count = Builder->CreateAdd(
+      Builder->CreateLoad(Int64Ty, CurrentProfile->Counter),
+      Builder->getInt64(1), "count");
+  Builder->CreateStore(Count, CurrentProfile->Counter);
+
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *TierUpBB = BasicBlock::Create(*TheContext, "tierup", TheFunction);
+  BasicBlock *CountedBB =
+      BasicBlock::Create(*TheContext, "counted", TheFunction);
+  Value *Hot = Builder->CreateICmpEQ(
+      Count, Builder->getInt64(CurrentProfile->Threshold), "hot");
+  Builder->CreateCondBr(Hot, TierUpBB, CountedBB);
+
+  Builder->SetInsertPoint(TierUpBB);
+  FunctionCallee TierUp = TheModule->getOrInsertFunction(
+      "kaleidoscopeTierUp", Builder->getVoidTy(), Builder->getInt32Ty());
+  Builder->CreateCall(TierUp, Builder->getInt32(CurrentProfile->Name));
+  Builder->CreateBr(CountedBB);
+  Builder->SetInsertPoint(CountedBB);
+}
+
+enum class FPMode { Strict, Contract, Reassoc, Fast };
+
+static cl::opt<FPMode> FPModeOpt(
+    "fp-mode", cl::desc("Fast-math flags on floating-point arithmetic and "
+                        "compares:"),
+    cl::init(FPMode::Strict),
+    cl::values(clEnumValN(FPMode::Strict, "strict", "None, IEEE-754 exactly"),
+               clEnumValN(FPMode::Contract, "contract",
+                          "Allow fusing a multiply and an add"),
+               clEnumValN(FPMode::Reassoc, "reassoc",
+                          "Also reassociate and ignore signed zeros"),
+               clEnumValN(FPMode::Fast, "fast",
+                          "All of them, also assuming no NaNs or "
+                          "infinities")));
+
+/// getFastMathFlags - The flags that Mode puts on floating-point instructions.
+static FastMathFlags getFastMathFlags(FPMode Mode) {
+  FastMathFlags FMF;
+  switch (Mode) {
+  case FPMode::Fast:
+    FMF.setFast();
+    break;
+  case FPMode::Reassoc:
+    FMF.setAllowReassoc();
+    FMF.setNoSignedZeros();
+    [[fallthrough]];
+  case FPMode::Contract:
+    FMF.setAllowContract();
+    break;
+  case FPMode::Strict:
+    break;
+  }
+  return FMF;
 }
 
-Value *VariableExprAST::codegen() {
+namespace {
+
+/// FPModeScope - While it lives, the builder puts the -fp-mode flags on the
+/// instructions it creates.  Only arithmetic and compares are generated in
+/// one: the flags on a phi or a call would also let LLVM assume things about
+/// values it didn't compute, such as a NaN that a callee returns.
+struct FPModeScope {
+  IRBuilder<>::FastMathFlagGuard Guard{*Builder};
+  FPModeScope() { Builder->setFastMathFlags(getFastMathFlags(FPModeOpt)); }
+};
+
+} // end anonymous namespace
+
+// The emit* helpers and emitters below build the IR for each kind of
+// expression once its operands have been generated, so the tree and the
+// FlatAST share one lowering.
+
+static Value *emitVariable(SymbolID Name) {
   // Look this variable up in the function.
-  Value *V = NamedValues[Name];
+  Value *V = NamedValues.lookup(Name);
   if (!V)
     return LogErrorV("Unknown variable name");
   return V;
 }
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R)
-    return nullptr;
-
+static Value *emitBinaryOp(char Op, Value *L, Value *R) {
+  FPModeScope FP;
   switch (Op) {
   case '+':
     return Builder->CreateFAdd(L, R, "addtmp");
@@ -594,192 +2412,514 @@ Value *BinaryExprAST::codegen() {
   }
 }
 
-Value *CallExprAST::codegen() {
+/// lookupCallee - The function a call refers to, checked before its arguments
+/// are generated.
+static Function *lookupCallee(SymbolID Callee, size_t NumArgs) {
   // Look up the name in the global module table.
   Function *CalleeF = getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unknown function referenced");
+  if (!CalleeF) {
+    LogErrorV("Unknown function referenced");
+    return nullptr;
+  }
 
   // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect # arguments passed");
-
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
-      return nullptr;
+  if (CalleeF->arg_size() != NumArgs) {
+    LogErrorV("Incorrect # arguments passed");
+    return nullptr;
   }
+  return CalleeF;
+}
 
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+static cl::opt<bool>
+    IntegerIVs("int-iv",
+               cl::desc("Count for loops with an integral constant start and "
+                        "step in an i64, for loop passes to analyse"));
+
+/// fitsIntegerIV - Whether a loop from Start by Step can count in an i64 and
+/// convert to double where the variable is used, with the same values as
+/// repeated double adds.  Those are exact up to 2^53, which within these
+/// bounds is at least 2^44 iterations away.  A -0.0 start is left alone, as
+/// it would convert back as +0.0.
+static bool fitsIntegerIV(double Start, double Step) {
+  return std::fabs(Start) <= 0x1p32 && std::fabs(Step) <= 0x1p8 &&
+         Start == std::trunc(Start) && Step == std::trunc(Step) &&
+         !(Start == 0.0 && std::signbit(Start));
 }
 
-Value *IfExprAST::codegen() {
-  Value *CondV = Cond->codegen();
-  if (!CondV)
+static cl::opt<unsigned>
+    ForVectorizeWidth("for-vectorize-width", cl::init(0),
+                      cl::desc("Ask the loop vectorizer for this width on "
+                               "every for loop (0 = its own choice)"));
+static cl::opt<unsigned>
+    ForUnrollCount("for-unroll-count", cl::init(0),
+                   cl::desc("Ask the loop unroller for this count on every "
+                            "for loop (0 = its own choice)"));
+
+/// makeLoopID - The llvm.loop metadata for a for loop's back edge, carrying
+/// the -for-vectorize-width and -for-unroll-count hints, or null if there are
+/// none.
+static MDNode *makeLoopID() {
+  SmallVector<Metadata *, 4> MDs = {nullptr}; // The loop ID refers to itself
+  auto AddHint = [&](StringRef Name, Constant *Val) {
+    MDs.push_back(MDNode::get(*TheContext, {MDString::get(*TheContext, Name),
+                                            ConstantAsMetadata::get(Val)}));
+  };
+  if (ForVectorizeWidth) {
+    AddHint("llvm.loop.vectorize.enable", Builder->getTrue());
+    AddHint("llvm.loop.vectorize.width", Builder->getInt32(ForVectorizeWidth));
+  }
+  if (ForUnrollCount)
+    AddHint("llvm.loop.unroll.count", Builder->getInt32(ForUnrollCount));
+  if (MDs.size() == 1)
     return nullptr;
+  MDNode *LoopID = MDNode::getDistinct(*TheContext, MDs);
+  LoopID->replaceOperandWith(0, LoopID);
+  return LoopID;
+}
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+namespace {
 
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+/// IfEmitter - Emits an if/then/else one step at a time, around the code for
+/// its condition, then and else values.
+class IfEmitter {
+  BasicBlock *ThenBB = nullptr, *ElseBB = nullptr, *MergeBB = nullptr;
+  Value *ThenV = nullptr;
 
-  // Create blocks for the then and else cases.  Insert the 'then' block at the
-  // end of the function.
-  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+public:
+  /// beginThen - Branch on CondV and start the 'then' block.
+  void beginThen(Value *CondV) {
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    FPModeScope FP;
+    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
 
-  Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-  // Emit then value.
-  Builder->SetInsertPoint(ThenBB);
-  Value *ThenV = Then->codegen();
-  if (!ThenV)
-    return nullptr;
-  Builder->CreateBr(MergeBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder->GetInsertBlock();
-
-  // Emit else block
-  TheFunction->insert(TheFunction->end(), ElseBB);
-  Builder->SetInsertPoint(ElseBB);
-  Value *ElseV = Else->codegen();
-  if (!ElseV)
-    return nullptr;
-  Builder->CreateBr(MergeBB);
-  // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = Builder->GetInsertBlock();
-
-  // Emit merge block
-  TheFunction->insert(TheFunction->end(), MergeBB);
-  Builder->SetInsertPoint(MergeBB);
-  PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
-  PN->addIncoming(ThenV, ThenBB);
-  PN->addIncoming(ElseV, ElseBB);
-
-  return PN;
-}
-
-// Output for-loop as:
-//   ...
-//   start = startexpr
-//   goto loop
-// loop:
-//   variable = phi [start, loopheader], [nextvariable, loopend]
-//   ...
-//   bodyexpr
-//   ...
-// loopend:
-//   step = stepexpr
-//   nextvariable = variable + step
-//   endcond = endexpr
-//   br endcond, loop, endloop
-// outloop:
-Value *ForExprAST::codegen() {
-  // Emit the start code first, without 'variable' in scope
-  Value *StartVal = Start->codegen();
-  if (!StartVal)
-    return nullptr;
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
-  BasicBlock *PreheaderBB = Builder->GetInsertBlock();
-  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    // Create blocks for the then and else cases.  Insert the 'then' block at
+    // the end of the function.
+    ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+    ElseBB = BasicBlock::Create(*TheContext, "else");
+    MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-  Builder->CreateBr(LoopBB);
-  Builder->SetInsertPoint(LoopBB);
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
-  PHINode *Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, VarName);
-  Variable->addIncoming(StartVal, PreheaderBB);
+    // Emit then value.
+    Builder->SetInsertPoint(ThenBB);
+  }
 
-  Value *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Variable;
+  /// beginElse - Finish the 'then' block with value V and start the 'else'
+  /// block.
+  void beginElse(Value *V) {
+    ThenV = V;
+    Builder->CreateBr(MergeBB);
+    // Codegen of 'Then' can change the current block, update ThenBB for the
+    // PHI.
+    ThenBB = Builder->GetInsertBlock();
+
+    // Emit else block
+    Function *TheFunction = ThenBB->getParent();
+    TheFunction->insert(TheFunction->end(), ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+  }
 
-  // Emit the body of the loop.  This, like any other expr, can change the
-  // current BB.  Note that we ignore the value computed by the body, but don't
-  // allow an error.
-  if (!Body->codegen())
-    return nullptr;
+  /// finish - Finish the 'else' block with value ElseV and merge the two.
+  Value *finish(Value *ElseV) {
+    Builder->CreateBr(MergeBB);
+    // Codegen of 'Else' can change the current block, update ElseBB for the
+    // PHI.
+    ElseBB = Builder->GetInsertBlock();
+
+    // Emit merge block
+    Function *TheFunction = ElseBB->getParent();
+    TheFunction->insert(TheFunction->end(), MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+  }
+};
 
-  Value *StepVal = nullptr;
-  if (Step) {
-    StepVal = Step->codegen();
-    if (!StepVal)
-      return nullptr;
-  } else {
-    StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+/// ForEmitter - Emits a for loop one step at a time.  The loop is output as:
+///   ...
+///   start = startexpr
+///   goto loop
+/// loop:
+///   variable = phi [start, loopheader], [nextvariable, loopend]
+///   ...
+///   bodyexpr
+///   ...
+/// loopend:
+///   step = stepexpr
+///   nextvariable = variable + step
+///   endcond = endexpr
+///   br endcond, loop, endloop
+/// outloop:
+/// When the start and step are integral constants (see fitsIntegerIV), the
+/// phi is an i64 counter stepped with an integer add, and the variable is
+/// its conversion to double.
+class ForEmitter {
+  SymbolID VarName = 0;
+  PHINode *Variable = nullptr; // The variable, or its i64 counter
+  ConstantInt *IntStep = nullptr; // The counter's step, if it has one
+  BasicBlock *LoopBB = nullptr;
+  size_t Scope = 0;
+  Value *NextVar = nullptr;
+
+public:
+  /// beginBody - Open the loop with StartVal, emitted without the variable in
+  /// scope, and bring the variable into scope for the body.  ConstStep is the
+  /// step when it is known to be a constant.
+  void beginBody(SymbolID Name, Value *StartVal,
+                 std::optional<double> ConstStep = std::nullopt) {
+    VarName = Name;
+    // Make the new basic block for the loop header, inserting after current
+    // block.
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+    LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+
+    Builder->CreateBr(LoopBB);
+    Builder->SetInsertPoint(LoopBB);
+
+    Scope = NamedValues.openScope();
+    auto *Start = dyn_cast<ConstantFP>(StartVal);
+    if (IntegerIVs && Start && ConstStep &&
+        fitsIntegerIV(Start->getValueAPF().convertToDouble(), *ConstStep)) {
+      IntegerType *Int64Ty = Type::getInt64Ty(*TheContext);
+      int64_t IntStart = (int64_t)Start->getValueAPF().convertToDouble();
+      IntStep = ConstantInt::get(Int64Ty, (int64_t)*ConstStep, true);
+      Variable = Builder->CreatePHI(Int64Ty, 2,
+                                    TheSymbols.getName(VarName) + ".iv");
+      Variable->addIncoming(ConstantInt::get(Int64Ty, IntStart, true),
+                            PreheaderBB);
+      NamedValues.bind(VarName, Builder->CreateSIToFP(
+                                    Variable, Type::getDoubleTy(*TheContext),
+                                    TheSymbols.getName(VarName)));
+      return;
+    }
+
+    Variable = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2,
+                                  TheSymbols.getName(VarName));
+    Variable->addIncoming(StartVal, PreheaderBB);
+    NamedValues.bind(VarName, Variable);
   }
 
-  Value *NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
+  /// step - Advance the variable by StepVal, or by 1.0 if the loop has no
+  /// step expression.  The value of the body is ignored.
+  void step(Value *StepVal) {
+    if (IntStep) {
+      NextVar = Builder->CreateNSWAdd(Variable, IntStep, "nextvar");
+      return;
+    }
+    if (!StepVal)
+      StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    FPModeScope FP;
+    NextVar = Builder->CreateFAdd(Variable, StepVal, "nextvar");
+  }
 
-  Value *EndCond = End->codegen();
-  if (!EndCond)
-    return nullptr;
+  /// finish - Loop back while EndCond is true, and restore the variable's
+  /// outer binding.
+  Value *finish(Value *EndCond) {
+    {
+      FPModeScope FP;
+      EndCond = Builder->CreateFCmpONE(
+          EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    }
+    emitProfileCount();
 
-  EndCond = Builder->CreateFCmpONE(EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    BasicBlock *LoopEndBB = Builder->GetInsertBlock();
+    Function *TheFunction = LoopEndBB->getParent();
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
 
-  BasicBlock *LoopEndBB = Builder->GetInsertBlock();
-  BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    BranchInst *BackEdge = Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    if (MDNode *LoopID = makeLoopID())
+      BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
 
-  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    Builder->SetInsertPoint(AfterBB);
 
-  Builder->SetInsertPoint(AfterBB);
+    Variable->addIncoming(NextVar, LoopEndBB);
 
-  Variable->addIncoming(NextVar, LoopEndBB);
+    NamedValues.closeScope(Scope);
 
-  if (OldVal)
-    NamedValues[VarName] = OldVal;
-  else
-    NamedValues.erase(VarName);
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  }
+};
+
+} // end anonymous namespace
+
+/// getConstantStep - The step of the for loop N, if it is a constant.
+template <typename ViewT>
+static std::optional<double> getConstantStep(const ViewT &View,
+                                             typename ViewT::NodeRef N) {
+  typename ViewT::NodeRef Step = View.getOperand(N, 2);
+  if (Step == ViewT::NoOperand)
+    return 1.0;
+  if (View.getKind(Step) == ExprKind::Number)
+    return View.getNumVal(Step);
+  return std::nullopt;
+}
+
+/// emitExpr - Generate code for the expression rooted at Root, read through
+/// View (a TreeView or FlatView).  The walk is iterative: each frame on Stack
+/// is a node and how far its code has got, and the values of finished
+/// operands wait on Values until their parent consumes them.  Operands are
+/// generated in the order the language defines: a loop's start, body, step
+/// and then end condition.  Returns null after reporting the first error.
+///
+/// A shared node is generated once and its value reused wherever that value
+/// dominates: entering an if arm or a loop opens a region, and leaving it
+/// forgets the values generated inside.  A loop whose variable shadows
+/// another binding hides everything generated outside it.
+template <typename ViewT>
+static Value *emitExpr(const ViewT &View, typename ViewT::NodeRef Root) {
+  using NodeRef = typename ViewT::NodeRef;
+  struct Frame {
+    NodeRef N;
+    unsigned Stage = 0;
+    Function *Callee = nullptr;
+    IfEmitter If;
+    ForEmitter For;
+
+    Frame(NodeRef N) : N(N) {}
+  };
+  SmallVector<Frame, 32> Stack;
+  SmallVector<Value *, 32> Values;
+  auto PopValue = [&] { return Values.pop_back_val(); };
+
+  struct Region {
+    size_t LogSize;
+    DenseMap<NodeRef, Value *> Hidden;
+  };
+  DenseMap<NodeRef, Value *> SharedValues;
+  SmallVector<NodeRef, 16> SharedLog; // The keys of SharedValues, in order
+  SmallVector<Region, 8> Regions;
+  auto OpenRegion = [&](bool Hide) {
+    Regions.emplace_back();
+    Regions.back().LogSize = SharedLog.size();
+    if (Hide)
+      std::swap(SharedValues, Regions.back().Hidden);
+  };
+  auto CloseRegion = [&] {
+    Region &R = Regions.back();
+    for (size_t I = R.LogSize, E = SharedLog.size(); I != E; ++I)
+      SharedValues.erase(SharedLog[I]);
+    SharedLog.resize(R.LogSize);
+    if (!R.Hidden.empty())
+      std::swap(SharedValues, R.Hidden);
+    Regions.pop_back();
+  };
+
+  Stack.emplace_back(Root);
+  while (!Stack.empty()) {
+    Frame &F = Stack.back();
+    NodeRef N = F.N;
+    // Either the next operand to generate, or the node's finished value.
+    NodeRef Next = ViewT::NoOperand;
+    Value *Result = nullptr;
+
+    if (F.Stage == 0 && View.isShared(N)) {
+      if (Value *V = SharedValues.lookup(N)) {
+        Values.push_back(V);
+        Stack.pop_back();
+        continue;
+      }
+    }
+
+    switch (View.getKind(N)) {
+    case ExprKind::Number:
+      Result = ConstantFP::get(*TheContext, APFloat(View.getNumVal(N)));
+      break;
+    case ExprKind::Variable:
+      if (!(Result = emitVariable(View.getSymbol(N))))
+        return nullptr;
+      break;
+    case ExprKind::Binary:
+      if (F.Stage < 2) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      {
+        Value *R = PopValue();
+        Value *L = PopValue();
+        if (!(Result = emitBinaryOp(View.getOp(N), L, R)))
+          return nullptr;
+      }
+      break;
+    case ExprKind::Call: {
+      unsigned NumArgs = View.getNumOperands(N);
+      if (F.Stage == 0 &&
+          !(F.Callee = lookupCallee(View.getSymbol(N), NumArgs)))
+        return nullptr;
+      if (F.Stage < NumArgs) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      ArrayRef<Value *> Args = ArrayRef<Value *>(Values).take_back(NumArgs);
+      Result = Builder->CreateCall(F.Callee, Args, "calltmp");
+      Values.resize(Values.size() - NumArgs);
+      break;
+    }
+    case ExprKind::If:
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0);
+        break;
+      case 1:
+        F.If.beginThen(PopValue());
+        OpenRegion(false);
+        Next = View.getOperand(N, 1);
+        break;
+      case 2:
+        CloseRegion();
+        F.If.beginElse(PopValue());
+        OpenRegion(false);
+        Next = View.getOperand(N, 2);
+        break;
+      default:
+        CloseRegion();
+        Result = F.If.finish(PopValue());
+        break;
+      }
+      break;
+    case ExprKind::For:
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0); // Start
+        break;
+      case 1:
+        OpenRegion(NamedValues.isBound(View.getSymbol(N)));
+        F.For.beginBody(View.getSymbol(N), PopValue(),
+                        getConstantStep(View, N));
+        Next = View.getOperand(N, 3); // Body
+        break;
+      case 2:
+        PopValue();
+        Next = View.getOperand(N, 2); // Step
+        if (Next != ViewT::NoOperand)
+          break;
+        F.For.step(nullptr);
+        ++F.Stage;
+        Next = View.getOperand(N, 1); // End
+        break;
+      case 3:
+        F.For.step(PopValue());
+        Next = View.getOperand(N, 1); // End
+        break;
+      default:
+        Result = F.For.finish(PopValue());
+        CloseRegion();
+        break;
+      }
+      break;
+    }
+
+    if (Result) {
+      if (View.isShared(N)) {
+        SharedValues[N] = Result;
+        SharedLog.push_back(N);
+      }
+      Values.push_back(Result);
+      Stack.pop_back();
+    } else {
+      Stack.emplace_back(Next);
+    }
+  }
+  return Values.back();
+}
+
+Value *FlatAST::codegen() const { return emitExpr(FlatView{*this}, Root); }
+
+/// emitLoopEntry - Generate a function that runs the for loop Loop from its
+/// header, for entering it part way through (on-stack replacement).  Its
+/// parameters are the loop variables in scope around the loop, named by
+/// Outer, and then the value of Loop's own variable for the next iteration.
+/// Returns null after reporting the first error.
+template <typename ViewT>
+static Function *emitLoopEntry(const ViewT &View, typename ViewT::NodeRef Loop,
+                               ArrayRef<SymbolID> Outer, const Twine &Name) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  std::vector<Type *> Doubles(Outer.size() + 1, DoubleTy);
+  FunctionType *FT = FunctionType::get(DoubleTy, Doubles, false);
+  Function *TheFunction = Function::Create(FT, Function::ExternalLinkage, Name,
+                                           TheModule.get());
+  Builder->SetInsertPoint(
+      BasicBlock::Create(*TheContext, "entry", TheFunction));
 
-  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  NamedValues.clear();
+  for (unsigned I = 0, E = Outer.size(); I != E; ++I)
+    NamedValues.bind(Outer[I], TheFunction->getArg(I));
+
+  ForEmitter For;
+  For.beginBody(View.getSymbol(Loop), TheFunction->getArg(Outer.size()));
+  Value *StepVal = nullptr, *EndCond = nullptr;
+  bool OK = emitExpr(View, View.getOperand(Loop, 3)); // Body
+  if (OK && View.getOperand(Loop, 2) != ViewT::NoOperand)
+    OK = (StepVal = emitExpr(View, View.getOperand(Loop, 2)));
+  if (OK) {
+    For.step(StepVal);
+    OK = (EndCond = emitExpr(View, View.getOperand(Loop, 1)));
+  }
+  if (!OK) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+  Builder->CreateRet(For.finish(EndCond));
+  verifyFunction(*TheFunction);
+  if (TheOptimizer)
+    TheOptimizer->run(*TheFunction);
+  return TheFunction;
 }
 
-Function *PrototypeAST::codegen() {
+Function *PrototypeAST::codegen(StringRef IRName) {
   // Make the function type:  double(double,double) etc.
   std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
   FunctionType *FT =
       FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
 
+  if (IRName.empty())
+    IRName = TheSymbols.getName(Name);
   Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+      Function::Create(FT, Function::ExternalLinkage, IRName, TheModule.get());
 
   // Set names for all arguments.
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(TheSymbols.getName(Args[Idx++]));
 
   return F;
 }
 
-Function *FunctionAST::codegen() {
-  // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
+Function *FunctionAST::codegen(StringRef IRName) {
+  // Register a copy of the prototype in the FunctionProtos map.  The
+  // definition keeps its own so that it can be compiled again.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  Function *TheFunction = getFunction(P.getName());
+  FunctionProtos[P.getName()] = std::make_unique<PrototypeAST>(P);
+  Function *TheFunction =
+      IRName.empty() ? getFunction(P.getName()) : P.codegen(IRName);
   if (!TheFunction)
     return nullptr;
 
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
   Builder->SetInsertPoint(BB);
+  emitProfileCount();
 
   // Record the function arguments in the NamedValues map.
   NamedValues.clear();
+  unsigned Idx = 0;
   for (auto &Arg : TheFunction->args())
-    NamedValues[std::string(Arg.getName())] = &Arg;
+    NamedValues.bind(P.getArgs()[Idx++], &Arg);
 
-  if (Value *RetVal = Body->codegen()) {
+  if (Value *RetVal = Body ? emitExpr(TreeView(), Body) : Flat->codegen()) {
     // Finish off the function.
     Builder->CreateRet(RetVal);
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
 
-    // Run the optimizer on the function.
-    TheFPM->run(*TheFunction);
+    // Run the optimizer on the function, unless this is tier-0 code.
+    if (TheOptimizer && !CurrentProfile)
+      TheOptimizer->run(*TheFunction);
 
     return TheFunction;
   }
@@ -790,158 +2930,3191 @@ Function *FunctionAST::codegen() {
 }
 
 //===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
+// Interpreter
 //===----------------------------------------------------------------------===//
 
-static void InitializeModuleAndPassManager() {
-  // Open a new module.
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+static void InitializeModuleAndPassManager();
+static ThreadSafeModule takeModule();
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+/// checkCallee - The checks codegen makes of a call, in the same order and
+/// with the same errors, for the engines that don't generate IR.
+static bool checkCallee(SymbolID Callee, size_t NumArgs) {
+  auto FI = FunctionProtos.find(Callee);
+  if (FI == FunctionProtos.end()) {
+    LogError("Unknown function referenced");
+    return false;
+  }
+  if (FI->second->getArgs().size() != NumArgs) {
+    LogError("Incorrect # arguments passed");
+    return false;
+  }
+  return true;
+}
 
-  // Create a new pass manager attached to it.
-  TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
-
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(createCFGSimplificationPass());
-  
-  TheFPM->doInitialization();
+/// MaxNativeArgs - The most arguments callNative can pass.
+static constexpr unsigned MaxNativeArgs = 6;
+
+/// callNative - Call the native function of type double(double, ...) at Fn.
+static double callNative(void *Fn, ArrayRef<double> A) {
+  using D = double;
+  switch (A.size()) {
+  case 0:
+    return ((D(*)())Fn)();
+  case 1:
+    return ((D(*)(D))Fn)(A[0]);
+  case 2:
+    return ((D(*)(D, D))Fn)(A[0], A[1]);
+  case 3:
+    return ((D(*)(D, D, D))Fn)(A[0], A[1], A[2]);
+  case 4:
+    return ((D(*)(D, D, D, D))Fn)(A[0], A[1], A[2], A[3]);
+  case 5:
+    return ((D(*)(D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4]);
+  case 6:
+    return ((D(*)(D, D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4], A[5]);
+  }
+  llvm_unreachable("too many arguments for a native call");
 }
 
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-      InitializeModuleAndPassManager();
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+namespace {
+
+/// ExprInterpreter - Evaluates a top-level expression straight from its AST,
+/// calling into the JIT for the functions it uses.  A one-off expression then
+/// costs microseconds instead of a module, the function passes and machine
+/// code generation.
+///
+/// Each expression is walked twice.  The first walk visits every node once,
+/// as codegen would, reporting the same errors before anything has run, and
+/// looks up the address of every function called.  The second evaluates.
+///
+/// A loop that turns out to be hot is moved into native code part way
+/// through: once it has gone round OSRThreshold times, it is compiled with
+/// emitLoopEntry and the call continues it from the next iteration, with
+/// the live loop variables as arguments.
+class ExprInterpreter {
+public:
+  /// Summary - What the checking walk found out about an expression.
+  struct Summary {
+    unsigned NumNodes = 0;
+    bool HasLoops = false;
+    bool CanInterpret = true;
+  };
+
+  /// check - Report any errors in F's body, and resolve its callees.
+  /// Returns false if there were errors.
+  bool check(const FunctionAST &F, Summary &S) {
+    Callees.clear();
+    double Unused;
+    return walk(F, &S, Unused);
+  }
+
+  /// evaluate - Run F's body, which must have been checked.  A nonzero
+  /// OSRThreshold enables compiling hot loops.
+  double evaluate(const FunctionAST &F, unsigned OSRThreshold = 0) {
+    this->OSRThreshold = OSRThreshold;
+    double Result = 0;
+    walk(F, nullptr, Result);
+    for (ResourceTrackerSP &RT : LoopCode)
+      ExitOnErr(RT->remove());
+    LoopCode.clear();
+    return Result;
+  }
+
+private:
+  DenseMap<SymbolID, void *> Callees;
+  SmallVector<std::pair<SymbolID, double>, 8> Vars; // Loop variables in scope
+  unsigned OSRThreshold = 0;
+  std::vector<ResourceTrackerSP> LoopCode; // Compiled loops, until the end
+
+  template <typename ViewT>
+  void *compileLoop(const ViewT &View, typename ViewT::NodeRef Loop);
+
+  bool resolve(SymbolID Callee, unsigned NumArgs, Summary &S);
+
+  bool walk(const FunctionAST &F, Summary *S, double &Result) {
+    if (const ExprAST *Body = F.getBody())
+      return walk(TreeView(), Body, S, Result);
+    const FlatAST &Flat = *F.getFlatBody();
+    return walk(FlatView{Flat}, Flat.getRoot(), S, Result);
+  }
+
+  template <typename ViewT>
+  bool walk(const ViewT &View, typename ViewT::NodeRef Root, Summary *S,
+            double &Result);
+};
+
+} // end anonymous namespace
+
+bool ExprInterpreter::resolve(SymbolID Callee, unsigned NumArgs, Summary &S) {
+  if (!checkCallee(Callee, NumArgs))
+    return false;
+  // Calls with more arguments than callNative handles are left to the JIT.
+  if (NumArgs > MaxNativeArgs) {
+    S.CanInterpret = false;
+    return true;
   }
+
+  void *&Fn = Callees[Callee];
+  if (!Fn) {
+    auto Sym = ExitOnErr(TheJIT->lookup(TheSymbols.getName(Callee)));
+    Fn = (void *)(intptr_t)Sym.getAddress();
+  }
+  return true;
 }
 
-static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+/// compileLoop - JIT the loop Loop, with the loop variables now in scope, as
+/// a function to enter it at its header.  Returns its address, or null.
+template <typename ViewT>
+void *ExprInterpreter::compileLoop(const ViewT &View,
+                                   typename ViewT::NodeRef Loop) {
+  SmallVector<SymbolID, 8> Outer;
+  for (auto &Var : Vars)
+    Outer.push_back(Var.first);
+  Outer.pop_back();
+
+  std::string Name = "__osr_loop" + std::to_string(LoopCode.size());
+  if (!emitLoopEntry(View, Loop, Outer, Name))
+    return nullptr;
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  ExitOnErr(TheJIT->addModule(takeModule(), RT));
+  InitializeModuleAndPassManager();
+  LoopCode.push_back(RT);
+
+  auto Sym = ExitOnErr(TheJIT->lookup(Name));
+  return (void *)(intptr_t)Sym.getAddress();
+}
+
+/// walk - Check (S non-null) or evaluate the expression rooted at Root, with
+/// an explicit stack like emitExpr.  When checking, both arms of an if are
+/// visited and a loop body once; when evaluating, the control flow is real.
+/// Values are computed exactly as the generated code would compute them.
+template <typename ViewT>
+bool ExprInterpreter::walk(const ViewT &View, typename ViewT::NodeRef Root,
+                           Summary *S, double &Result) {
+  using NodeRef = typename ViewT::NodeRef;
+  struct Frame {
+    NodeRef N;
+    unsigned Stage = 0;
+    double NextVar = 0;      // For: the value of the next iteration
+    unsigned Iterations = 0; // For: back edges taken
+
+    Frame(NodeRef N) : N(N) {}
+  };
+  SmallVector<Frame, 32> Stack;
+  SmallVector<double, 32> Values;
+  DenseMap<NodeRef, void *> LoopEntries; // Compiled loops; null if failed
+  auto PopValue = [&] { return Values.pop_back_val(); };
+  auto IsTrue = [](double V) { return V != 0.0 && !std::isnan(V); };
+
+  Stack.emplace_back(Root);
+  while (!Stack.empty()) {
+    Frame &F = Stack.back();
+    NodeRef N = F.N;
+    // Either the next operand to evaluate, or the node is done with value V.
+    NodeRef Next = ViewT::NoOperand;
+    bool Done = false;
+    double V = 0;
+
+    switch (View.getKind(N)) {
+    case ExprKind::Number:
+      V = View.getNumVal(N);
+      Done = true;
+      break;
+    case ExprKind::Variable: {
+      SymbolID Name = View.getSymbol(N);
+      auto It = find_if(reverse(Vars), [&](auto &Var) {
+        return Var.first == Name;
+      });
+      if (It == Vars.rend()) {
+        LogError("Unknown variable name");
+        return false;
+      }
+      V = It->second;
+      Done = true;
+      break;
+    }
+    case ExprKind::Binary: {
+      if (F.Stage < 2) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      double R = PopValue();
+      double L = PopValue();
+      switch (View.getOp(N)) {
+      case '+':
+        V = L + R;
+        break;
+      case '-':
+        V = L - R;
+        break;
+      case '*':
+        V = L * R;
+        break;
+      case '<':
+        V = !(L >= R);
+        break;
+      default:
+        LogError("invalid binary operator");
+        return false;
+      }
+      Done = true;
+      break;
+    }
+    case ExprKind::Call: {
+      unsigned NumArgs = View.getNumOperands(N);
+      SymbolID Callee = View.getSymbol(N);
+      if (F.Stage == 0 && S && !resolve(Callee, NumArgs, *S))
+        return false;
+      if (F.Stage < NumArgs) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      ArrayRef<double> Args = ArrayRef<double>(Values).take_back(NumArgs);
+      V = S ? 0 : callNative(Callees.lookup(Callee), Args);
+      Values.resize(Values.size() - NumArgs);
+      Done = true;
+      break;
+    }
+    case ExprKind::If:
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0);
+        break;
+      case 1: {
+        double Cond = PopValue();
+        if (S) { // Check the then arm, and the else arm after it.
+          Next = View.getOperand(N, 1);
+          break;
+        }
+        Next = View.getOperand(N, IsTrue(Cond) ? 1 : 2);
+        F.Stage = 3;
+        break;
+      }
+      case 2:
+        PopValue();
+        Next = View.getOperand(N, 2);
+        break;
+      default:
+        V = PopValue();
+        Done = true;
+        break;
+      }
+      break;
+    case ExprKind::For:
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0); // Start
+        break;
+      case 1:
+        Vars.push_back({View.getSymbol(N), PopValue()});
+        Next = View.getOperand(N, 3); // Body
+        break;
+      case 2:
+        PopValue();
+        Next = View.getOperand(N, 2); // Step
+        if (Next == ViewT::NoOperand)
+          Values.push_back(1.0);
+        else
+          break;
+        ++F.Stage;
+        [[fallthrough]];
+      case 3:
+        F.NextVar = Vars.back().second + PopValue();
+        Next = View.getOperand(N, 1); // End
+        break;
+      default:
+        if (!S && IsTrue(PopValue())) {
+          Vars.back().second = F.NextVar;
+          // Enter native code once the loop is hot, or straight away if it
+          // was compiled on an earlier trip through the enclosing code.
+          if (OSRThreshold && Vars.size() <= MaxNativeArgs &&
+              (++F.Iterations >= OSRThreshold || LoopEntries.count(N))) {
+            auto Ins = LoopEntries.try_emplace(N, nullptr);
+            if (Ins.second)
+              Ins.first->second = compileLoop(View, N);
+            if (void *Entry = Ins.first->second) {
+              SmallVector<double, 8> Args;
+              for (auto &Var : Vars)
+                Args.push_back(Var.second);
+              V = callNative(Entry, Args);
+              Vars.pop_back();
+              Done = true;
+              break;
+            }
+          }
+          F.Stage = 2;
+          Next = View.getOperand(N, 3); // Body
+          break;
+        }
+        if (S)
+          S->HasLoops = true;
+        Vars.pop_back();
+        Done = true;
+        break;
+      }
+      break;
+    }
+
+    if (Done) {
+      if (S)
+        ++S->NumNodes;
+      Values.push_back(V);
+      Stack.pop_back();
+    } else {
+      Stack.emplace_back(Next);
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
   }
+  Result = Values.back();
+  return true;
 }
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+//===----------------------------------------------------------------------===//
+// Bytecode VM
+//===----------------------------------------------------------------------===//
 
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      InitializeModuleAndPassManager();
+namespace {
 
-      auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+/// BytecodeOp - The instructions of the bytecode VM.  Operands A, B and C are
+/// registers of the current frame unless noted otherwise.
+enum BytecodeOp : uint8_t {
+  BC_LoadConst,   // A = Consts[B]
+  BC_Move,        // A = B
+  BC_Add,         // A = B + C
+  BC_Sub,         // A = B - C
+  BC_Mul,         // A = B * C
+  BC_Less,        // A = B < C, true when unordered like fcmp ult
+  BC_Jump,        // Continue at instruction B
+  BC_JumpIfFalse, // Continue at instruction B if A is zero or NaN
+  BC_Call,        // A = Slots[B] called with the arguments in C, C+1, ...
+  BC_Ret,         // Return A
+  BC_NumOps
+};
 
-      // double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-      double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+struct BytecodeInst {
+  BytecodeOp Op;
+  uint32_t A = 0, B = 0, C = 0;
+};
 
-      ExitOnErr(RT->remove());
-    }
+/// BytecodeFunction - A function compiled for the VM.  Its parameters arrive
+/// in registers 0 to NumParams-1.
+struct BytecodeFunction {
+  unsigned NumParams = 0;
+  unsigned NumRegs = 0;
+  std::vector<BytecodeInst> Code;
+  std::vector<double> Consts;
+
+  size_t getMemoryUsage() const {
+    return sizeof(*this) + Code.capacity() * sizeof(BytecodeInst) +
+           Consts.capacity() * sizeof(double);
+  }
+};
+
+/// BytecodeVM - Compiles functions to register bytecode and runs them, as an
+/// execution engine that needs no JIT, no LLVM module and no machine code:
+/// compiling a function costs one walk over its body, and it then occupies a
+/// few hundred bytes.
+///
+/// Every function the program calls has a slot in the native call table,
+/// which a Call instruction names by index.  A slot holds the function's
+/// bytecode once it is defined, or for an extern the address of the native
+/// function it was bound to by name on its first call.  Calls into bytecode
+/// don't recurse in C++: the callee's frame starts at the caller's argument
+/// registers, so its parameters are already in place.
+class BytecodeVM {
+  struct Slot {
+    SymbolID Name;
+    std::unique_ptr<BytecodeFunction> Code;
+    void *Native = nullptr;
+  };
+  std::vector<Slot> Slots;
+  DenseMap<SymbolID, unsigned> SlotIndex;
+  std::vector<double> Regs;
+
+  unsigned getSlot(SymbolID Name);
+  bool bindNative(Slot &S);
+
+  template <typename ViewT>
+  bool compileExpr(const ViewT &View, typename ViewT::NodeRef Root,
+                   SmallVectorImpl<std::pair<SymbolID, unsigned>> &Scope,
+                   BytecodeFunction &Fn);
+
+public:
+  /// compile - Compile F, reporting the errors codegen would.  Like codegen,
+  /// registers F's prototype in FunctionProtos.  Returns null on error.
+  std::unique_ptr<BytecodeFunction> compile(const FunctionAST &F);
+
+  /// define - Compile F and make it the function its name refers to.
+  const BytecodeFunction *define(const FunctionAST &F);
+
+  /// run - Call Fn, which takes no arguments.  Returns false if it called an
+  /// extern that couldn't be bound.
+  bool run(const BytecodeFunction &Fn, double &Result);
+
+  /// evaluate - Compile and run a top-level expression.
+  bool evaluate(const FunctionAST &F, double &Result) {
+    std::unique_ptr<BytecodeFunction> Fn = compile(F);
+    return Fn && run(*Fn, Result);
+  }
+
+  /// getMemoryUsage - The bytes used by the code of all defined functions.
+  size_t getMemoryUsage() const {
+    size_t Bytes = 0;
+    for (const Slot &S : Slots)
+      if (S.Code)
+        Bytes += S.Code->getMemoryUsage();
+    return Bytes;
+  }
+
+  /// reset - Forget every function and binding.
+  void reset() {
+    Slots.clear();
+    SlotIndex.clear();
+  }
+
+  static void dump(const BytecodeFunction &Fn, raw_ostream &OS);
+};
+
+} // end anonymous namespace
+
+unsigned BytecodeVM::getSlot(SymbolID Name) {
+  auto Ins = SlotIndex.try_emplace(Name, Slots.size());
+  if (Ins.second) {
+    Slots.emplace_back();
+    Slots.back().Name = Name;
+  }
+  return Ins.first->second;
+}
+
+bool BytecodeVM::bindNative(Slot &S) {
+  static bool Loaded = !sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  std::string Name = TheSymbols.getName(S.Name).str();
+  if (Loaded)
+    S.Native = sys::DynamicLibrary::SearchForAddressOfSymbol(Name);
+  if (!S.Native) {
+    LogError(("Unresolved extern '" + Name + "'").c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<BytecodeFunction> BytecodeVM::compile(const FunctionAST &F) {
+  const PrototypeAST &P = F.getProto();
+  FunctionProtos[P.getName()] = std::make_unique<PrototypeAST>(P);
+
+  auto Fn = std::make_unique<BytecodeFunction>();
+  SmallVector<std::pair<SymbolID, unsigned>, 8> Scope;
+  for (SymbolID Arg : P.getArgs())
+    Scope.push_back({Arg, Fn->NumParams++});
+
+  bool Compiled;
+  if (const ExprAST *Body = F.getBody()) {
+    Compiled = compileExpr(TreeView(), Body, Scope, *Fn);
   } else {
-    // Skip token for error recovery.
-    getNextToken();
+    const FlatAST &Flat = *F.getFlatBody();
+    Compiled = compileExpr(FlatView{Flat}, Flat.getRoot(), Scope, *Fn);
   }
+  if (!Compiled)
+    return nullptr;
+  return Fn;
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "ready> ");
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';': // ignore top-level semicolons.
-      getNextToken();
+const BytecodeFunction *BytecodeVM::define(const FunctionAST &F) {
+  std::unique_ptr<BytecodeFunction> Fn = compile(F);
+  if (!Fn)
+    return nullptr;
+  Slot &S = Slots[getSlot(F.getName())];
+  S.Code = std::move(Fn);
+  S.Native = nullptr;
+  return S.Code.get();
+}
+
+/// compileExpr - Append code for the expression rooted at Root to Fn, ending
+/// with its Ret, with an explicit stack like emitExpr.  Registers are handed
+/// out as a stack: a node's temporaries start at the first free register,
+/// which also receives its value.  Variables are not copied; the operand
+/// that uses one reads its register directly.
+template <typename ViewT>
+bool BytecodeVM::compileExpr(
+    const ViewT &View, typename ViewT::NodeRef Root,
+    SmallVectorImpl<std::pair<SymbolID, unsigned>> &Scope,
+    BytecodeFunction &Fn) {
+  using NodeRef = typename ViewT::NodeRef;
+  struct Frame {
+    NodeRef N;
+    unsigned Stage = 0;
+    unsigned Base;     // The register that receives the node's value
+    unsigned Slot = 0; // Call: the callee
+    unsigned Fixup = 0; // If: the jump to patch; For: the loop head
+
+    Frame(NodeRef N, unsigned Base) : N(N), Base(Base) {}
+  };
+  SmallVector<Frame, 32> Stack;
+  SmallVector<unsigned, 32> Values; // The register holding each value
+  unsigned NextReg = Fn.NumParams;
+
+  auto Emit = [&](BytecodeOp Op, unsigned A, unsigned B = 0, unsigned C = 0) {
+    Fn.Code.push_back({Op, A, B, C});
+    return unsigned(Fn.Code.size() - 1);
+  };
+  auto EmitConst = [&](unsigned Dst, double Val) {
+    Emit(BC_LoadConst, Dst, Fn.Consts.size());
+    Fn.Consts.push_back(Val);
+  };
+  auto PatchJump = [&](unsigned Jump) { Fn.Code[Jump].B = Fn.Code.size(); };
+  auto SetNextReg = [&](unsigned Reg) {
+    NextReg = Reg;
+    Fn.NumRegs = std::max(Fn.NumRegs, Reg);
+  };
+
+  Stack.emplace_back(Root, NextReg);
+  while (!Stack.empty()) {
+    Frame &F = Stack.back();
+    NodeRef N = F.N;
+    // Either the next operand to compile, or the node is done with its value
+    // in register R.
+    NodeRef Next = ViewT::NoOperand;
+    bool Done = false;
+    unsigned R = F.Base;
+
+    switch (View.getKind(N)) {
+    case ExprKind::Number:
+      EmitConst(F.Base, View.getNumVal(N));
+      SetNextReg(F.Base + 1);
+      Done = true;
       break;
-    case tok_def:
-      HandleDefinition();
+    case ExprKind::Variable: {
+      SymbolID Name = View.getSymbol(N);
+      auto It = find_if(reverse(Scope), [&](auto &Var) {
+        return Var.first == Name;
+      });
+      if (It == Scope.rend()) {
+        LogError("Unknown variable name");
+        return false;
+      }
+      R = It->second;
+      Done = true;
       break;
-    case tok_extern:
-      HandleExtern();
+    }
+    case ExprKind::Binary: {
+      if (F.Stage < 2) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      unsigned RHS = Values.pop_back_val();
+      unsigned LHS = Values.pop_back_val();
+      BytecodeOp Op;
+      switch (View.getOp(N)) {
+      case '+':
+        Op = BC_Add;
+        break;
+      case '-':
+        Op = BC_Sub;
+        break;
+      case '*':
+        Op = BC_Mul;
+        break;
+      case '<':
+        Op = BC_Less;
+        break;
+      default:
+        LogError("invalid binary operator");
+        return false;
+      }
+      Emit(Op, F.Base, LHS, RHS);
+      SetNextReg(F.Base + 1);
+      Done = true;
       break;
-    default:
-      HandleTopLevelExpression();
+    }
+    case ExprKind::Call: {
+      // The arguments go in consecutive registers from Base, which is where
+      // the callee's frame will start.
+      unsigned NumArgs = View.getNumOperands(N);
+      if (F.Stage == 0) {
+        if (!checkCallee(View.getSymbol(N), NumArgs))
+          return false;
+        F.Slot = getSlot(View.getSymbol(N));
+      } else {
+        unsigned Arg = Values.pop_back_val();
+        unsigned Want = F.Base + F.Stage - 1;
+        if (Arg != Want)
+          Emit(BC_Move, Want, Arg);
+        SetNextReg(Want + 1);
+      }
+      if (F.Stage < NumArgs) {
+        Next = View.getOperand(N, F.Stage++);
+        break;
+      }
+      Emit(BC_Call, F.Base, F.Slot, F.Base);
+      SetNextReg(F.Base + 1);
+      Done = true;
+      break;
+    }
+    case ExprKind::If:
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0);
+        break;
+      case 1:
+        F.Fixup = Emit(BC_JumpIfFalse, Values.pop_back_val());
+        SetNextReg(F.Base);
+        Next = View.getOperand(N, 1);
+        break;
+      case 2: {
+        unsigned Then = Values.pop_back_val();
+        if (Then != F.Base)
+          Emit(BC_Move, F.Base, Then);
+        unsigned Jump = Emit(BC_Jump, 0);
+        PatchJump(F.Fixup);
+        F.Fixup = Jump;
+        SetNextReg(F.Base);
+        Next = View.getOperand(N, 2);
+        break;
+      }
+      default: {
+        unsigned Else = Values.pop_back_val();
+        if (Else != F.Base)
+          Emit(BC_Move, F.Base, Else);
+        PatchJump(F.Fixup);
+        SetNextReg(F.Base + 1);
+        Done = true;
+        break;
+      }
+      }
+      break;
+    case ExprKind::For: {
+      // The loop variable lives in Base and its next value in Base+1.
+      unsigned Var = F.Base, NextVar = F.Base + 1;
+      switch (F.Stage++) {
+      case 0:
+        Next = View.getOperand(N, 0); // Start
+        break;
+      case 1: {
+        unsigned Start = Values.pop_back_val();
+        if (Start != Var)
+          Emit(BC_Move, Var, Start);
+        SetNextReg(Var + 1);
+        Scope.push_back({View.getSymbol(N), Var});
+        F.Fixup = Fn.Code.size();
+        Next = View.getOperand(N, 3); // Body
+        break;
+      }
+      case 2:
+        Values.pop_back();
+        SetNextReg(Var + 1);
+        Next = View.getOperand(N, 2); // Step
+        if (Next != ViewT::NoOperand)
+          break;
+        EmitConst(NextVar, 1.0);
+        Values.push_back(NextVar);
+        ++F.Stage;
+        [[fallthrough]];
+      case 3:
+        Emit(BC_Add, NextVar, Var, Values.pop_back_val());
+        SetNextReg(NextVar + 1);
+        Next = View.getOperand(N, 1); // End
+        break;
+      default: {
+        unsigned Exit = Emit(BC_JumpIfFalse, Values.pop_back_val());
+        Emit(BC_Move, Var, NextVar);
+        Emit(BC_Jump, 0, F.Fixup);
+        PatchJump(Exit);
+        Scope.pop_back();
+        // for expr always returns 0.0.
+        EmitConst(Var, 0.0);
+        SetNextReg(Var + 1);
+        Done = true;
+        break;
+      }
+      }
       break;
     }
+    }
+
+    if (Done) {
+      Values.push_back(R);
+      Stack.pop_back();
+    } else {
+      Stack.emplace_back(Next, NextReg);
+    }
   }
+  Emit(BC_Ret, Values.back());
+  Fn.NumRegs = std::max(Fn.NumRegs, NextReg);
+  return true;
 }
 
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
+// Dispatch through a table of label addresses where the compiler supports
+// it, which gives every instruction its own indirect branch; otherwise
+// through a switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define KALEIDOSCOPE_VM_THREADED 1
+#endif
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
+bool BytecodeVM::run(const BytecodeFunction &Entry, double &Result) {
+  struct CallFrame {
+    const BytecodeFunction *Fn;
+    const BytecodeInst *ReturnPC;
+    size_t Base;
+    uint32_t Dst;
+  };
+  SmallVector<CallFrame, 16> Frames;
+  const BytecodeFunction *Fn = &Entry;
+  const BytecodeInst *PC = Fn->Code.data();
+  const BytecodeInst *I;
+  size_t Base = 0;
+  if (Regs.size() < Fn->NumRegs)
+    Regs.resize(Fn->NumRegs);
+  double *R = Regs.data();
+  const double *K = Fn->Consts.data();
+
+#ifdef KALEIDOSCOPE_VM_THREADED
+  static const void *const Labels[] = {
+      &&L_LoadConst, &&L_Move, &&L_Add,  &&L_Sub, &&L_Mul,
+      &&L_Less,      &&L_Jump, &&L_JumpIfFalse, &&L_Call, &&L_Ret};
+  static_assert(std::size(Labels) == BC_NumOps, "missing opcode label");
+#define VM_CASE(Op) L_##Op:
+#define VM_NEXT() goto *Labels[(I = PC++)->Op]
+  VM_NEXT();
 #else
-#define DLLEXPORT
+#define VM_CASE(Op) case BC_##Op:
+#define VM_NEXT() continue
+  for (;;) {
+    I = PC++;
+    switch (I->Op) {
 #endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
+  VM_CASE(LoadConst) {
+    R[I->A] = K[I->B];
+    VM_NEXT();
+  }
+  VM_CASE(Move) {
+    R[I->A] = R[I->B];
+    VM_NEXT();
+  }
+  VM_CASE(Add) {
+    R[I->A] = R[I->B] + R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Sub) {
+    R[I->A] = R[I->B] - R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Mul) {
+    R[I->A] = R[I->B] * R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Less) {
+    R[I->A] = !(R[I->B] >= R[I->C]);
+    VM_NEXT();
+  }
+  VM_CASE(Jump) {
+    PC = Fn->Code.data() + I->B;
+    VM_NEXT();
+  }
+  VM_CASE(JumpIfFalse) {
+    double Cond = R[I->A];
+    if (!(Cond != 0.0 && !std::isnan(Cond)))
+      PC = Fn->Code.data() + I->B;
+    VM_NEXT();
+  }
+  VM_CASE(Call) {
+    Slot &S = Slots[I->B];
+    if (const BytecodeFunction *Callee = S.Code.get()) {
+      Frames.push_back({Fn, PC, Base, I->A});
+      Base += I->C;
+      if (Regs.size() < Base + Callee->NumRegs)
+        Regs.resize(std::max(Base + Callee->NumRegs, 2 * Regs.size()));
+      Fn = Callee;
+      PC = Fn->Code.data();
+      R = Regs.data() + Base;
+      K = Fn->Consts.data();
+      VM_NEXT();
+    }
+    if (!S.Native && !bindNative(S))
+      return false;
+    size_t NumArgs = FunctionProtos[S.Name]->getArgs().size();
+    if (NumArgs > MaxNativeArgs) {
+      LogError("Too many arguments for a native call");
+      return false;
+    }
+    R[I->A] = callNative(S.Native, ArrayRef<double>(R + I->C, NumArgs));
+    VM_NEXT();
+  }
+  VM_CASE(Ret) {
+    double Val = R[I->A];
+    if (Frames.empty()) {
+      Result = Val;
+      return true;
+    }
+    CallFrame Caller = Frames.pop_back_val();
+    Fn = Caller.Fn;
+    PC = Caller.ReturnPC;
+    Base = Caller.Base;
+    R = Regs.data() + Base;
+    K = Fn->Consts.data();
+    R[Caller.Dst] = Val;
+    VM_NEXT();
+  }
+#ifndef KALEIDOSCOPE_VM_THREADED
+    case BC_NumOps:
+      break;
+    }
+    llvm_unreachable("invalid bytecode");
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
+void BytecodeVM::dump(const BytecodeFunction &Fn, raw_ostream &OS) {
+  static const char *const Names[] = {"const", "move", "add", "sub", "mul",
+                                      "less",  "jump", "jumpiffalse", "call",
+                                      "ret"};
+  static_assert(std::size(Names) == BC_NumOps, "missing opcode name");
+  OS << "bytecode: " << Fn.NumParams << " params, " << Fn.NumRegs
+     << " registers\n";
+  for (size_t PC = 0; PC != Fn.Code.size(); ++PC) {
+    const BytecodeInst &I = Fn.Code[PC];
+    OS << format("%4zu  %-12s", PC, Names[I.Op]);
+    switch (I.Op) {
+    case BC_LoadConst:
+      OS << 'r' << I.A << ", " << Fn.Consts[I.B];
+      break;
+    case BC_Move:
+      OS << 'r' << I.A << ", r" << I.B;
+      break;
+    case BC_Jump:
+      OS << I.B;
+      break;
+    case BC_JumpIfFalse:
+      OS << 'r' << I.A << ", " << I.B;
+      break;
+    case BC_Call:
+      OS << 'r' << I.A << ", #" << I.B << ", r" << I.C;
+      break;
+    case BC_Ret:
+      OS << 'r' << I.A;
+      break;
+    default:
+      OS << 'r' << I.A << ", r" << I.B << ", r" << I.C;
+      break;
+    }
+    OS << '\n';
+  }
 }
 
+static BytecodeVM TheVM;
+
 //===----------------------------------------------------------------------===//
-// Main driver code.
+// Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-int main() {
-  // Initialize the LLVM backend.
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
+enum class PipelineKind { Tutorial, O0, O1, O2, O3, Os };
+
+static cl::opt<PipelineKind> OptLevel(
+    "O", cl::desc("Optimize with LLVM's standard pipeline at a level, in "
+                  "place of the tutorial's passes:"),
+    cl::Prefix, cl::init(PipelineKind::Tutorial),
+    cl::values(clEnumValN(PipelineKind::O0, "0", "No optimization"),
+               clEnumValN(PipelineKind::O1, "1", "Fast optimizations"),
+               clEnumValN(PipelineKind::O2, "2", "Most optimizations"),
+               clEnumValN(PipelineKind::O3, "3", "All optimizations"),
+               clEnumValN(PipelineKind::Os, "s", "Optimize for size")));
+
+enum class PipelineScope { Function, Module };
+
+static cl::opt<PipelineScope> OptScope(
+    "opt-scope", cl::desc("Run the optimization pipeline on:"),
+    cl::init(PipelineScope::Function),
+    cl::values(clEnumValN(PipelineScope::Function, "function",
+                          "Each function as soon as it is generated"),
+               clEnumValN(PipelineScope::Module, "module",
+                          "Each module as it is handed to the JIT, which "
+                          "also runs -O's interprocedural passes")));
+
+static cl::opt<std::string>
+    PassPipeline("passes", cl::value_desc("pipeline"),
+                 cl::desc("Run this pipeline, in opt's -passes syntax, in "
+                          "place of the tutorial's passes or -O"));
+
+static cl::opt<bool>
+    InlineDefs("inline-defs",
+               cl::desc("Keep the optimized IR of small definitions, and "
+                        "inline it into later ones that call them"));
+
+static cl::opt<unsigned> InlineDefsLimit(
+    "inline-defs-limit", cl::init(100),
+    cl::desc("For -inline-defs, the most instructions a definition can have "
+             "and still be kept"));
+
+static cl::opt<bool>
+    LoopOpts("loop-opts",
+             cl::desc("Run loop optimizations and the vectorizers after the "
+                      "tutorial's passes"));
+
+/// getTargetMachine - A target machine like the one the JIT compiles with, for
+/// the cost models of the vectorizers and the unroller.
+static TargetMachine &getTargetMachine() {
+  static std::unique_ptr<TargetMachine> TM = [] {
+    auto Host = ExitOnErr(JITTargetMachineBuilder::detectHost());
+    return ExitOnErr(
+        JITTargetMachineBuilder(Host.getTargetTriple()).createTargetMachine());
+  }();
+  return *TM;
+}
 
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
+/// isPassManager - Whether PassID names a pass that only runs other passes.
+static bool isPassManager(StringRef PassID) {
+  return PassID.contains("PassManager") || PassID.contains("PassAdaptor") ||
+         PassID.contains("AnalysisManagerProxy");
+}
 
-  // Prime the first token.
-  fprintf(stderr, "ready> ");
-  getNextToken();
+void PassTimes::start(StringRef Name) {
+  if (!isPassManager(Name))
+    Stack.push_back({Name, std::chrono::steady_clock::now(), 0});
+}
 
-  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+void PassTimes::stop(StringRef Name) {
+  if (isPassManager(Name))
+    return;
+  Running R = Stack.pop_back_val();
+  assert(R.Name == Name && "passes finished out of order");
+  double Seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - R.Start)
+                       .count();
+  Total &T = Totals[Name];
+  T.Seconds += Seconds - R.Nested;
+  ++T.Runs;
+  if (!Stack.empty())
+    Stack.back().Nested += Seconds;
+}
+
+void PassTimes::registerCallbacks(PassInstrumentationCallbacks &PIC) {
+  PIC.registerBeforeNonSkippedPassCallback(
+      [this](StringRef P, Any) { start(P); });
+  PIC.registerAfterPassCallback(
+      [this](StringRef P, Any, const PreservedAnalyses &) { stop(P); });
+  PIC.registerAfterPassInvalidatedCallback(
+      [this](StringRef P, const PreservedAnalyses &) { stop(P); });
+  PIC.registerBeforeAnalysisCallback([this](StringRef P, Any) { start(P); });
+  PIC.registerAfterAnalysisCallback([this](StringRef P, Any) { stop(P); });
+}
+
+void PassTimes::print(raw_ostream &OS) const {
+  std::vector<std::pair<StringRef, Total>> Sorted;
+  double Sum = 0;
+  for (auto &KV : Totals) {
+    Sorted.push_back({KV.getKey(), KV.getValue()});
+    Sum += KV.getValue().Seconds;
+  }
+  llvm::sort(Sorted, [](const auto &A, const auto &B) {
+    return A.second.Seconds > B.second.Seconds;
+  });
+  OS << "Optimizer time per pass:\n";
+  for (auto &[Name, T] : Sorted)
+    OS << format("%10.3fms %5.1f%% %7u  ", T.Seconds * 1e3,
+                 Sum ? T.Seconds * 100 / Sum : 0.0, T.Runs)
+       << Name << '\n';
+  OS << format("%10.3fms total\n", Sum * 1e3);
+}
+
+static PassTimes ThePassTimes;
+
+/// getTutorialPipeline - The tutorial's function passes, and with -loop-opts
+/// the loop optimizations and vectorizers after them.
+static std::string getTutorialPipeline() {
+  // Promote allocas to registers, do simple "peephole" optimizations,
+  // reassociate expressions, eliminate common subexpressions and simplify the
+  // control flow graph (deleting unreachable blocks, etc).
+  std::string Pipeline = "mem2reg,instcombine,reassociate,gvn,simplifycfg";
+  if (LoopOpts)
+    // Hoist loop-invariant code out of rotated loops, so that there is a
+    // preheader to hoist it into.  Canonicalize induction variables and
+    // compute trip counts, delete loops whose only effect was to count, and
+    // unroll.  Vectorize loops, then straight-line code, and clean up.
+    Pipeline += ",loop-mssa(loop-rotate,licm),loop(indvars,loop-deletion),"
+                "loop-unroll,loop-vectorize,slp-vectorizer,instcombine,"
+                "simplifycfg";
+  return Pipeline;
+}
+
+Optimizer::Optimizer() {
+  if (TimePassesIsEnabled)
+    ThePassTimes.registerCallbacks(PIC);
+
+  OptimizationLevel Level = OptimizationLevel::O0;
+  switch (OptLevel) {
+  case PipelineKind::Tutorial:
+  case PipelineKind::O0:
+    break;
+  case PipelineKind::O1:
+    Level = OptimizationLevel::O1;
+    break;
+  case PipelineKind::O2:
+    Level = OptimizationLevel::O2;
+    break;
+  case PipelineKind::O3:
+    Level = OptimizationLevel::O3;
+    break;
+  case PipelineKind::Os:
+    Level = OptimizationLevel::Os;
+    break;
+  }
+  // Vectorize from -O2 on, as clang does.  The target machine gives the
+  // cost models the real target instead of a generic one.
+  PipelineTuningOptions PTO;
+  PTO.LoopVectorization = PTO.SLPVectorization =
+      Level.getSpeedupLevel() >= 2;
+  PassBuilder PB(&getTargetMachine(), PTO, {}, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  bool WholeModule = OptScope == PipelineScope::Module;
+  if (!PassPipeline.empty() || OptLevel == PipelineKind::Tutorial) {
+    std::string Text =
+        PassPipeline.empty() ? getTutorialPipeline() : PassPipeline;
+    if (WholeModule)
+      ExitOnErr(PB.parsePassPipeline(MPM, Text));
+    else
+      ExitOnErr(PB.parsePassPipeline(FPM, Text));
+  } else if (WholeModule) {
+    MPM = PB.buildPerModuleDefaultPipeline(Level);
+  } else if (Level != OptimizationLevel::O0) {
+    FPM = PB.buildFunctionSimplificationPipeline(Level,
+                                                 ThinOrFullLTOPhase::None);
+  }
+
+  if (InlineDefs)
+    ExitOnErr(PB.parsePassPipeline(InlineMPM, "cgscc(inline)"));
+}
+
+void Optimizer::run(Function &F) {
+  if (FPM.isEmpty())
+    return;
+  FPM.run(F, FAM);
+  FAM.clear();
+}
+
+void Optimizer::run(Module &M) {
+  if (MPM.isEmpty())
+    return;
+  MPM.run(M, MAM);
+  MAM.clear();
+  CGAM.clear();
+  FAM.clear();
+  LAM.clear();
+}
+
+void Optimizer::inlineImported(Module &M) {
+  // The module pipeline may have inlined and dropped them already.
+  if (none_of(M, [](Function &F) { return F.hasAvailableExternallyLinkage(); }))
+    return;
+
+  // Note which functions the inliner changes, to clean up only those.
+  SmallPtrSet<Function *, 4> Changed;
+  for (Function &F : M)
+    if (!F.isDeclaration() && !F.hasAvailableExternallyLinkage())
+      for (Instruction &I : instructions(F))
+        if (auto *CI = dyn_cast<CallInst>(&I))
+          if (Function *Callee = CI->getCalledFunction())
+            if (Callee->hasAvailableExternallyLinkage())
+              Changed.insert(&F);
+  InlineMPM.run(M, MAM);
+  if (!FPM.isEmpty())
+    for (Function *F : Changed)
+      FPM.run(*F, FAM);
+  MAM.clear();
+  CGAM.clear();
+  FAM.clear();
+  LAM.clear();
+
+  // The JIT has the real definitions; it needn't compile the copies again.
+  for (Function &F : M)
+    if (F.hasAvailableExternallyLinkage())
+      F.deleteBody();
+}
+
+/// isKeptName - Whether a definition is one that later code can call by name,
+/// rather than an expression, an OSR loop entry or one tier of a function.
+static bool isKeptName(StringRef Name) {
+  return !Name.startswith("__") && !Name.contains('.');
+}
+
+bool InlinableDefinitions::import(Module &M) {
+  // Group the definitions by the module they were kept from, so that each
+  // is read once.
+  SmallVector<std::shared_ptr<const std::string>, 4> Sources;
+  for (Function &F : M)
+    if (F.isDeclaration()) {
+      auto I = Bitcode.find(F.getName());
+      if (I != Bitcode.end() && !is_contained(Sources, I->second))
+        Sources.push_back(I->second);
+    }
+
+  for (auto &Source : Sources) {
+    auto Src = ExitOnErr(parseBitcodeFile(
+        MemoryBufferRef(*Source, "kept definitions"), M.getContext()));
+    for (Function &F : *Src)
+      if (!F.isDeclaration())
+        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    // Only the definitions that M declares come over.
+    if (Linker::linkModules(M, std::move(Src), Linker::LinkOnlyNeeded))
+      ExitOnErr(make_error<StringError>("cannot link a kept definition",
+                                        inconvertibleErrorCode()));
+  }
+  return !Sources.empty();
+}
+
+void InlinableDefinitions::save(const Module &M) {
+  SmallVector<StringRef, 2> Names;
+  for (const Function &F : M)
+    if (!F.isDeclaration() && isKeptName(F.getName()) &&
+        F.getInstructionCount() <= InlineDefsLimit)
+      Names.push_back(F.getName());
+  if (Names.empty())
+    return;
+
+  auto Source = std::make_shared<std::string>();
+  raw_string_ostream OS(*Source);
+  WriteBitcodeToFile(M, OS);
+  OS.flush();
+  for (StringRef Name : Names)
+    Bitcode[Name] = Source;
+}
+
+static void InitializeModuleAndPassManager() {
+  // Open a new module.
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+  TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  // Create a new builder for the module.
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+  // The optimizer keeps nothing about the modules it has run on, so it lasts
+  // from one module to the next.  Code that wants IR left as generated, or
+  // has changed the options, resets it.
+  if (!TheOptimizer)
+    TheOptimizer = std::make_unique<Optimizer>();
+}
+
+/// takeModule - Run the module pipeline over TheModule and hand it over, with
+/// its context, for the JIT.  Call InitializeModuleAndPassManager to go on.
+static ThreadSafeModule takeModule() {
+  if (TheOptimizer) {
+    // With -inline-defs, bring in copies of the definitions it calls first.
+    bool Imported = InlineDefs && SavedDefinitions.import(*TheModule);
+    TheOptimizer->run(*TheModule);
+    if (Imported)
+      TheOptimizer->inlineImported(*TheModule);
+  }
+  if (InlineDefs)
+    SavedDefinitions.save(*TheModule);
+  return ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+}
+
+/// Fold - Off by default: folding a constant if drops the arm that isn't
+/// taken before codegen has checked it, so an unknown variable or function
+/// there is no longer reported.
+static cl::opt<FoldMode> Fold(
+    "fold",
+    cl::desc("Simplify expressions before generating code (the untaken arm "
+             "of a constant if is dropped unchecked):"),
+    cl::init(FoldMode::None),
+    cl::values(clEnumValN(FoldMode::None, "none", "No folding"),
+               clEnumValN(FoldMode::Strict, "strict",
+                          "Only where the result is exact under IEEE-754"),
+               clEnumValN(FoldMode::Fast, "fast",
+                          "Also assume no NaNs or infinities, ignore signed "
+                          "zeros and reassociate")));
+
+static cl::opt<bool>
+    UseFlatAST("flat-ast",
+               cl::desc("Flatten each function body into index-linked "
+                        "arrays before generating code"));
+
+static cl::opt<bool>
+    ShareExprs("share-exprs",
+               cl::desc("Hash-cons the pure subexpressions of every function "
+                        "body and generate each one once per function"));
+
+static cl::opt<bool>
+    PrintAST("print-ast",
+             cl::desc("Print each definition and top-level expression as it "
+                      "is about to be compiled or run"));
+
+/// SharedExprs - The pure subexpressions of every body seen, for -share-exprs.
+static SharedExprTable SharedExprs;
+
+/// prepareBody - Get a freshly parsed function ready for code generation.
+/// A flattened body keeps no sharing, so -flat-ast overrides -share-exprs.
+static void prepareBody(FunctionAST &F) {
+  F.simplifyBody(Fold);
+  if (UseFlatAST)
+    F.flattenBody();
+  else if (ShareExprs)
+    F.shareBody(SharedExprs);
+}
+
+static cl::opt<unsigned>
+    ParseJobs("parse-jobs", cl::init(1),
+              cl::desc("Lex the input and parse its definitions on this many "
+                       "threads (0 = one per core); implies -pretokenize"));
+
+namespace {
+
+/// DefinitionPrepass - Parses every definition in a token buffer up front, on
+/// a thread pool.  'def' can never appear inside an expression, so each one
+/// starts an item that parses the same way whatever comes before it.  The
+/// main loop still walks the items in order and picks each definition up when
+/// it gets there, so externs and top-level expressions run exactly when they
+/// would have.
+class DefinitionPrepass {
+  struct Item {
+    size_t Begin; // Index of the 'def' token
+    size_t End;   // Index of the token the parser stopped at
+    std::unique_ptr<FunctionAST> Fn; // Null if the definition had an error
+    std::string Errors;              // Reported when the item is taken
+  };
+  std::vector<Item> Items;
+  size_t NextItem = 0;
+
+public:
+  DefinitionPrepass(const TokenBuffer &Toks, unsigned Jobs);
+
+  size_t getNumDefinitions() const { return Items.size(); }
+
+  /// take - The definition starting at P's current token, ready for codegen,
+  /// with P moved past it to where parsing stopped.  Parses it on the spot if
+  /// it wasn't one of ours.
+  std::unique_ptr<FunctionAST> take(Parser &P);
+};
+
+} // end anonymous namespace
+
+DefinitionPrepass::DefinitionPrepass(const TokenBuffer &Toks, unsigned Jobs) {
+  for (size_t I = 0, E = Toks.size(); I != E; ++I)
+    if (Toks.getKind(I) == tok_def)
+      Items.push_back({I, I, nullptr, {}});
+
+  // Hand out runs of consecutive definitions, several per thread so that one
+  // run of unusually large functions doesn't hold up everything else.
+  ThreadPoolStrategy Strategy = hardware_concurrency(Jobs);
+  size_t RunLength = std::max<size_t>(
+      1, Items.size() / (Strategy.compute_thread_count() * 8));
+  ThreadPool Pool(Strategy);
+  for (size_t Begin = 0; Begin < Items.size(); Begin += RunLength) {
+    size_t End = std::min(Begin + RunLength, Items.size());
+    Pool.async([this, &Toks, Begin, End] {
+      Parser P(Toks);
+      for (size_t I = Begin; I != End; ++I) {
+        Item &It = Items[I];
+        DeferredErrors = &It.Errors;
+        P.seekToken(It.Begin);
+        It.Fn = P.ParseDefinition();
+        It.End = P.getTokenIndex();
+        if (It.Fn)
+          prepareBody(*It.Fn);
+      }
+      DeferredErrors = nullptr;
+    });
+  }
+  Pool.wait();
+}
+
+std::unique_ptr<FunctionAST> DefinitionPrepass::take(Parser &P) {
+  // Error recovery in the main loop may have skipped over some 'def' tokens;
+  // their definitions are never used.
+  size_t Idx = P.getTokenIndex();
+  while (NextItem != Items.size() && Items[NextItem].Begin < Idx)
+    ++NextItem;
+  if (NextItem == Items.size() || Items[NextItem].Begin != Idx) {
+    auto FnAST = P.ParseDefinition();
+    if (FnAST)
+      prepareBody(*FnAST);
+    return FnAST;
+  }
+
+  Item &It = Items[NextItem++];
+  fputs(It.Errors.c_str(), stderr);
+  P.seekToken(It.End);
+  return std::move(It.Fn);
+}
+
+static cl::opt<bool>
+    Incremental("incremental",
+                cl::desc("Treat each input file as a new version of the same "
+                         "script, recompiling only the definitions that "
+                         "changed and their callers; implies -pretokenize"));
+
+namespace {
+
+/// DefinitionCache - For -incremental, the compiled state of every function
+/// the script defines.  A definition whose AST is the same as in the previous
+/// version keeps its JIT'd code, whatever happened to its spacing and
+/// comments; the hash only finds candidates, and the saved AST is compared
+/// node by node before anything is reused.  Replacing a function's code
+/// leaves its callers calling the old address, so their code is discarded as
+/// well and rebuilt from their saved ASTs before anything can run them.
+class DefinitionCache {
+  struct Entry {
+    uint64_t Fingerprint = 0;
+    std::unique_ptr<FunctionAST> AST;
+    ResourceTrackerSP RT;             // Owns the code; null while stale
+    SmallVector<SymbolID, 4> Callees; // Functions the code refers to
+    unsigned Version = 0;             // Last version that defined it
+  };
+  DenseMap<SymbolID, Entry> Entries;
+  std::vector<SymbolID> Stale;
+  unsigned Version = 1;
+
+  bool compile(Entry &E, bool Echo);
+  void discardCallers(SymbolID Name);
+  void forget(SymbolID Name);
+
+public:
+  /// define - Compile FnAST, unless the same definition was compiled before.
+  void define(std::unique_ptr<FunctionAST> FnAST);
+
+  /// recompileStale - Rebuild the code of every caller of a function that
+  /// changed.
+  void recompileStale();
+
+  /// finishVersion - Drop the functions this version of the script no longer
+  /// defines, and get ready for the next one.
+  void finishVersion();
+};
+
+} // end anonymous namespace
+
+static DefinitionCache CompiledDefinitions;
+
+bool DefinitionCache::compile(Entry &E, bool Echo) {
+  auto *FnIR = E.AST->codegen();
+  if (!FnIR)
+    return false;
+  if (Echo) {
+    fprintf(stderr, "Read function definition:");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+  }
+
+  // Anything the function calls was declared in its module.
+  E.Callees.clear();
+  for (Function &F : *TheModule)
+    if (F.isDeclaration())
+      E.Callees.push_back(TheSymbols.intern(F.getName()));
+
+  E.RT = TheJIT->getMainJITDylib().createResourceTracker();
+  ExitOnErr(TheJIT->addModule(takeModule(), E.RT));
+  InitializeModuleAndPassManager();
+  return true;
+}
+
+void DefinitionCache::discardCallers(SymbolID Name) {
+  SmallVector<SymbolID, 8> Worklist = {Name};
+  while (!Worklist.empty()) {
+    SymbolID Callee = Worklist.pop_back_val();
+    for (auto &KV : Entries) {
+      Entry &E = KV.second;
+      if (!E.RT || !is_contained(E.Callees, Callee))
+        continue;
+      ExitOnErr(E.RT->remove());
+      E.RT = nullptr;
+      Stale.push_back(KV.first);
+      Worklist.push_back(KV.first);
+    }
+  }
+}
+
+void DefinitionCache::forget(SymbolID Name) {
+  auto I = Entries.find(Name);
+  if (I == Entries.end())
+    return;
+  if (I->second.RT)
+    ExitOnErr(I->second.RT->remove());
+  Entries.erase(I);
+  SavedDefinitions.forget(TheSymbols.getName(Name));
+  discardCallers(Name);
+}
+
+void DefinitionCache::define(std::unique_ptr<FunctionAST> FnAST) {
+  SymbolID Name = FnAST->getName();
+  uint64_t Fingerprint = FnAST->hash();
+  Entry &E = Entries[Name];
+  if (E.RT && E.Fingerprint == Fingerprint && E.AST->isSameAs(*FnAST)) {
+    fprintf(stderr, "Reused function definition: %s\n",
+            TheSymbols.getName(Name).str().c_str());
+    E.Version = Version;
+    return;
+  }
+
+  if (E.RT) {
+    ExitOnErr(E.RT->remove());
+    E.RT = nullptr;
+    discardCallers(Name);
+  }
+  E.Fingerprint = Fingerprint;
+  E.AST = std::move(FnAST);
+  E.Version = Version;
+  if (!compile(E, /*Echo=*/true))
+    forget(Name);
+}
+
+void DefinitionCache::recompileStale() {
+  while (!Stale.empty()) {
+    SymbolID Name = Stale.back();
+    Stale.pop_back();
+    auto I = Entries.find(Name);
+    if (I == Entries.end() || I->second.RT)
+      continue;
+    if (compile(I->second, /*Echo=*/false))
+      fprintf(stderr, "Recompiled caller: %s\n",
+              TheSymbols.getName(Name).str().c_str());
+    else
+      forget(Name);
+  }
+}
+
+void DefinitionCache::finishVersion() {
+  SmallVector<SymbolID, 4> Dropped;
+  for (auto &KV : Entries)
+    if (KV.second.Version != Version)
+      Dropped.push_back(KV.first);
+  for (SymbolID Name : Dropped) {
+    forget(Name);
+    FunctionProtos.erase(Name);
+  }
+  recompileStale();
+  ++Version;
+}
+
+static cl::opt<bool>
+    Tiered("tiered",
+           cl::desc("Compile definitions unoptimized and with counters "
+                    "first, and optimize the ones that get hot"));
+
+static cl::opt<uint64_t> TierUpThreshold(
+    "tier-up-threshold", cl::init(1000),
+    cl::desc("Calls plus loop iterations after which -tiered optimizes a "
+             "function"));
+
+namespace {
+
+/// TieredFunctions - For -tiered, the definitions compiled in two tiers.  A
+/// function f is first generated as f.t0, without optimizing it and with a
+/// counter bumped on entry and on every loop back edge.  The symbol f itself
+/// is a stub that calls through the pointer f.impl, so that when the counter
+/// reaches the threshold f.t0 can call promote(), which compiles f.t1 from
+/// the saved AST through the full pipeline and points f.impl at it.  Every
+/// caller, including activations of f.t0 already running, goes to the
+/// optimized code from its next call on.
+class TieredFunctions {
+  struct Entry {
+    std::unique_ptr<FunctionAST> AST;
+    bool Promoted = false;
+  };
+  DenseMap<SymbolID, Entry> Entries;
+
+public:
+  /// define - Compile FnAST at tier 0 and its stub.  Returns the tier-0
+  /// function, or null on error.
+  Function *define(std::unique_ptr<FunctionAST> FnAST);
+
+  /// promote - Compile the optimized tier of Name and switch its stub to it.
+  void promote(SymbolID Name);
+};
+
+} // end anonymous namespace
+
+static TieredFunctions TieredCode;
+
+Function *TieredFunctions::define(std::unique_ptr<FunctionAST> FnAST) {
+  SymbolID Name = FnAST->getName();
+  std::string IRName = TheSymbols.getName(Name).str();
+
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  auto *Counter = new GlobalVariable(
+      *TheModule, Int64Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantInt::get(Int64Ty, 0), IRName + ".count");
+  TierProfile Profile{Counter, Name, TierUpThreshold};
+  CurrentProfile = &Profile;
+  Function *Tier0 = FnAST->codegen(IRName + ".t0");
+  CurrentProfile = nullptr;
+  if (!Tier0) {
+    Counter->eraseFromParent();
+    return nullptr;
+  }
+  // The JIT's code generator is shared by both tiers; optnone has it compile
+  // tier-0 functions as it would at -O0.
+  Tier0->addFnAttr(Attribute::NoInline);
+  Tier0->addFnAttr(Attribute::OptimizeNone);
+
+  // The stub: a tail call through f.impl.  Calls from f.t0 to f already
+  // declared it.
+  Function *Stub = getFunction(Name);
+  FunctionType *FT = Tier0->getFunctionType();
+  PointerType *ImplTy = PointerType::getUnqual(FT);
+  auto *Impl = new GlobalVariable(*TheModule, ImplTy, /*isConstant=*/false,
+                                  GlobalValue::ExternalLinkage, Tier0,
+                                  IRName + ".impl");
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Stub));
+  SmallVector<Value *, 4> Args;
+  for (auto &Arg : Stub->args())
+    Args.push_back(&Arg);
+  CallInst *Call =
+      Builder->CreateCall(FT, Builder->CreateLoad(ImplTy, Impl, "impl"), Args);
+  Call->setTailCall();
+  Builder->CreateRet(Call);
+  verifyFunction(*Stub);
+
+  Entries[Name] = {std::move(FnAST), false};
+  return Tier0;
+}
+
+void TieredFunctions::promote(SymbolID Name) {
+  auto It = Entries.find(Name);
+  if (It == Entries.end() || It->second.Promoted)
+    return;
+  It->second.Promoted = true;
+
+  // Tier-0 code only runs between top-level items, when TheModule is empty.
+  std::string IRName = TheSymbols.getName(Name).str();
+  if (!It->second.AST->codegen(IRName + ".t1"))
+    return;
+  ExitOnErr(TheJIT->addModule(takeModule()));
+  InitializeModuleAndPassManager();
+
+  auto Tier1 = ExitOnErr(TheJIT->lookup(IRName + ".t1"));
+  auto Impl = ExitOnErr(TheJIT->lookup(IRName + ".impl"));
+  *(void **)(intptr_t)Impl.getAddress() = (void *)(intptr_t)Tier1.getAddress();
+  fprintf(stderr, "Optimized hot function %s\n", IRName.c_str());
+}
+
+enum class EngineKind { JIT, VM };
+
+static cl::opt<EngineKind> Engine(
+    "engine", cl::desc("Run the program with:"), cl::init(EngineKind::JIT),
+    cl::values(clEnumValN(EngineKind::JIT, "jit", "The ORC JIT"),
+               clEnumValN(EngineKind::VM, "vm",
+                          "The bytecode VM, without generating native code")));
+
+static void HandleDefinition(Parser &P, DefinitionPrepass *Prepass) {
+  if (auto FnAST = Prepass ? Prepass->take(P) : P.ParseDefinition()) {
+    if (!Prepass)
+      prepareBody(*FnAST);
+    if (PrintAST)
+      FnAST->print(errs());
+    if (Engine == EngineKind::VM) {
+      if (auto *Fn = TheVM.define(*FnAST)) {
+        fprintf(stderr, "Read function definition:\n");
+        BytecodeVM::dump(*Fn, errs());
+      }
+      return;
+    }
+    if (Incremental) {
+      CompiledDefinitions.define(std::move(FnAST));
+      return;
+    }
+    if (Tiered) {
+      if (auto *FnIR = TieredCode.define(std::move(FnAST))) {
+        fprintf(stderr, "Read function definition:");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+        // Tier-0 code, and the stub with it, skip the module pipeline too.
+        ExitOnErr(TheJIT->addModule(
+            ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+        InitializeModuleAndPassManager();
+      }
+      return;
+    }
+    if (auto *FnIR = FnAST->codegen()) {
+      fprintf(stderr, "Read function definition:");
+      FnIR->print(errs());
+      fprintf(stderr, "\n");
+      ExitOnErr(TheJIT->addModule(takeModule()));
+      InitializeModuleAndPassManager();
+    }
+  } else {
+    // Skip token for error recovery.
+    P.getNextToken();
+  }
+}
+
+static void HandleExtern(Parser &P) {
+  if (auto ProtoAST = P.ParseExtern()) {
+    if (Engine == EngineKind::VM) {
+      // Bound to the native function on its first call.
+      fprintf(stderr, "Read extern: %s\n",
+              TheSymbols.getName(ProtoAST->getName()).str().c_str());
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      return;
+    }
+    if (auto *FnIR = ProtoAST->codegen()) {
+      fprintf(stderr, "Read extern: ");
+      FnIR->print(errs());
+      fprintf(stderr, "\n");
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    }
+  } else {
+    // Skip token for error recovery.
+    P.getNextToken();
+  }
+}
+
+enum class InterpretPolicy { Never, Auto, Always };
+
+static cl::opt<InterpretPolicy> Interpret(
+    "interpret", cl::desc("When to evaluate top-level expressions with the "
+                          "interpreter instead of the JIT:"),
+    cl::init(InterpretPolicy::Never),
+    cl::values(clEnumValN(InterpretPolicy::Never, "never", "Always JIT"),
+               clEnumValN(InterpretPolicy::Auto, "auto",
+                          "Interpret small expressions without loops"),
+               clEnumValN(InterpretPolicy::Always, "always",
+                          "Interpret whenever possible")));
+
+static cl::opt<unsigned> InterpretMaxNodes(
+    "interpret-max-nodes", cl::init(1000),
+    cl::desc("Largest expression -interpret=auto leaves to the interpreter"));
+
+static cl::opt<bool>
+    OSR("osr", cl::desc("Let -interpret=auto interpret top-level loops "
+                        "too, and move interpreted loops into native code "
+                        "when they get hot"));
+
+static cl::opt<unsigned>
+    OSRThreshold("osr-threshold", cl::init(1000),
+                 cl::desc("Iterations after which -osr compiles a loop"));
+
+static ExprInterpreter TheInterpreter;
+
+/// shouldInterpret - Whether to interpret an expression, given what checking
+/// it found.  Native code wins for anything that loops, unless -osr will get
+/// it there, or is big enough that compiling it is not the dominant cost;
+/// calls are native either way.
+///
+/// The interpreter computes in strict IEEE-754 arithmetic, which the -O and
+/// -passes pipelines preserve but -fp-mode does not, so under a non-strict
+/// -fp-mode every expression is JIT-compiled to give the same results.
+static bool shouldInterpret(const ExprInterpreter::Summary &S) {
+  if (!S.CanInterpret || FPModeOpt != FPMode::Strict)
+    return false;
+  switch (Interpret) {
+  case InterpretPolicy::Never:
+    return false;
+  case InterpretPolicy::Auto:
+    return (!S.HasLoops || OSR) && S.NumNodes <= InterpretMaxNodes;
+  case InterpretPolicy::Always:
+    return true;
+  }
+  llvm_unreachable("unknown interpret policy");
+}
+
+/// EvaluateWithJIT - Compile a top-level expression into an anonymous
+/// function, run it and throw the code away.
+static bool EvaluateWithJIT(FunctionAST &FnAST, double &Result) {
+  if (!FnAST.codegen())
+    return false;
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  ExitOnErr(TheJIT->addModule(takeModule(), RT));
+  InitializeModuleAndPassManager();
+
+  auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+
+  // double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
+  double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+  Result = FP();
+
+  ExitOnErr(RT->remove());
+  return true;
+}
+
+/// Evaluate - Evaluate a top-level expression with the bytecode VM, or with
+/// the interpreter or the JIT as the -interpret policy decides.
+static bool Evaluate(FunctionAST &FnAST, double &Result) {
+  if (Engine == EngineKind::VM)
+    return TheVM.evaluate(FnAST, Result);
+  if (Interpret != InterpretPolicy::Never) {
+    ExprInterpreter::Summary S;
+    if (!TheInterpreter.check(FnAST, S))
+      return false;
+    if (shouldInterpret(S)) {
+      Result = TheInterpreter.evaluate(FnAST, OSR ? OSRThreshold : 0);
+      return true;
+    }
+  }
+  return EvaluateWithJIT(FnAST, Result);
+}
+
+static void HandleTopLevelExpression(Parser &P) {
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto FnAST = P.ParseTopLevelExpr()) {
+    prepareBody(*FnAST);
+    if (PrintAST)
+      FnAST->print(errs());
+    if (Incremental)
+      CompiledDefinitions.recompileStale();
+    double Result;
+    if (Evaluate(*FnAST, Result))
+      fprintf(stderr, "Evaluated to %f\n", Result);
+  } else {
+    // Skip token for error recovery.
+    P.getNextToken();
+  }
+}
+
+/// top ::= definition | external | expression | ';'
+static void MainLoop(Parser &P, DefinitionPrepass *Prepass = nullptr) {
+  while (true) {
+    fprintf(stderr, "ready> ");
+    switch (P.getCurTok()) {
+    case tok_eof:
+      return;
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_def:
+      HandleDefinition(P, Prepass);
+      break;
+    case tok_extern:
+      HandleExtern(P);
+      break;
+    default:
+      HandleTopLevelExpression(P);
+      break;
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+/// kaleidoscopeTierUp - Called by the tier-0 code of a -tiered function when
+/// it gets hot.
+extern "C" DLLEXPORT void kaleidoscopeTierUp(uint32_t Name) {
+  TieredCode.promote(Name);
+}
+
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+enum BenchKind {
+  BenchNone,
+  BenchLex,
+  BenchNumbers,
+  BenchTokenize,
+  BenchParse,
+  BenchFlat,
+  BenchParallelParse,
+  BenchDeep,
+  BenchFold,
+  BenchInterpret,
+  BenchVM,
+  BenchOSR,
+  BenchShare,
+  BenchVisit,
+  BenchLoops,
+  BenchOpt,
+  BenchFPMode,
+  BenchInline
+};
+
+static cl::opt<BenchKind> Bench(
+    "bench", cl::desc("Run a benchmark instead of the JIT driver"),
+    cl::init(BenchNone),
+    cl::values(clEnumValN(BenchLex, "lex",
+                          "Lexer throughput, scalar vs SIMD scanning"),
+               clEnumValN(BenchNumbers, "numbers",
+                          "Numeric literals, from_chars vs strtod"),
+               clEnumValN(BenchTokenize, "tokenize",
+                          "Pre-tokenizing, and parsing from tokens vs the "
+                          "lexer"),
+               clEnumValN(BenchParse, "parse",
+                          "Parsing large expressions into arenas"),
+               clEnumValN(BenchFlat, "flat",
+                          "Memory and codegen time, tree vs flat AST"),
+               clEnumValN(BenchParallelParse, "parallel-parse",
+                          "Parsing definitions on one thread vs "
+                          "-parse-jobs threads"),
+               clEnumValN(BenchDeep, "deep",
+                          "Parsing and codegen of very deeply nested "
+                          "expressions on a small stack"),
+               clEnumValN(BenchFold, "fold",
+                          "Compiling constant-heavy top-level expressions "
+                          "under each -fold mode"),
+               clEnumValN(BenchInterpret, "interpret",
+                          "Evaluating top-level expressions with the JIT vs "
+                          "the interpreter"),
+               clEnumValN(BenchVM, "vm",
+                          "Running programs with the JIT vs the bytecode "
+                          "VM"),
+               clEnumValN(BenchOSR, "osr",
+                          "A single huge top-level loop with the JIT, the "
+                          "interpreter and the interpreter with -osr"),
+               clEnumValN(BenchShare, "share",
+                          "Memory and code size of definitions that repeat "
+                          "subexpressions, with and without -share-exprs"),
+               clEnumValN(BenchVisit, "visit",
+                          "Flattening and folding through ExprWalker vs the "
+                          "switches they replaced"),
+               clEnumValN(BenchLoops, "loops",
+                          "Nested for loops with double vs i64 loop "
+                          "counters"),
+               clEnumValN(BenchOpt, "opt",
+                          "Compile time and run time under each "
+                          "optimization pipeline"),
+               clEnumValN(BenchFPMode, "fp-mode",
+                          "Floating-point kernels under each -fp-mode"),
+               clEnumValN(BenchInline, "inline",
+                          "Calls to small earlier definitions, with and "
+                          "without -inline-defs")));
+
+/// timeSeconds - Run F and return the elapsed wall clock time in seconds.
+template <typename Fn> static double timeSeconds(Fn F) {
+  auto Start = std::chrono::steady_clock::now();
+  F();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  return Elapsed.count();
+}
+
+/// takeBenchInput - The benchmark input is the file named on the command line
+/// if there is one, otherwise whatever Generate() produces.
+template <typename Fn>
+static std::unique_ptr<MemoryBuffer>
+takeBenchInput(std::unique_ptr<MemoryBuffer> &Input, Fn Generate) {
+  if (Input)
+    return std::move(Input);
+  return MemoryBuffer::getMemBufferCopy(Generate(), "<generated>");
+}
+
+/// generateLexInput - Roughly what our script generators emit: comment
+/// banners, long identifiers and short arithmetic bodies.
+static std::string generateLexInput(size_t Size) {
+  std::string Banner = "#" + std::string(78, '=') + "\n";
+  std::string S;
+  for (unsigned I = 0; S.size() < Size; ++I) {
+    std::string Name = "generatedKernelStage" + std::to_string(I) +
+                       "ComputeWeightedNeighbourhoodSum";
+    S += Banner;
+    S += "# " + Name + " - automatically generated, do not edit.\n";
+    S += Banner;
+    S += "def " + Name + "(inputValueAlpha inputValueBeta)\n";
+    S += "  if inputValueAlpha < " + std::to_string(I) +
+         ".5 then inputValueBeta * 2 else inputValueAlpha - inputValueBeta;\n";
+    S += Name + "(1, 2);\n\n";
+  }
+  return S;
+}
+
+/// lexAll - Lex Input to the end, returning the number of tokens.
+static size_t lexAll(StringRef Input, bool SIMD) {
+  SymbolTable Symbols;
+  Lexer Lex(Symbols, MemoryBuffer::getMemBuffer(Input, "<bench>"));
+  Lex.setUseSIMD(SIMD);
+  size_t NumTokens = 0;
+  while (Lex.gettok() != tok_eof)
+    ++NumTokens;
+  return NumTokens;
+}
+
+static void runLexBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] { return generateLexInput(64 << 20); });
+  double MB = Input->getBufferSize() / (1024.0 * 1024.0);
+
+  for (bool SIMD : {false, true}) {
+    size_t NumTokens = 0;
+    double Best = 1e30;
+    for (int Run = 0; Run < 5; ++Run)
+      Best = std::min(Best, timeSeconds([&] {
+                        NumTokens = lexAll(Input->getBuffer(), SIMD);
+                      }));
+    fprintf(stderr, "lex %-6s %8.1f MB in %7.3fs: %8.1f MB/s (%zu tokens)\n",
+            SIMD ? "simd" : "scalar", MB, Best, MB / Best, NumTokens);
+  }
+}
+
+/// generateNumberInput - A constant table of Count literals in the forms the
+/// lexer accepts: integers, fractions, exponents and hex floats.
+static std::string generateNumberInput(unsigned Count) {
+  std::string S;
+  char Buf[64];
+  for (unsigned I = 0; I != Count; ++I) {
+    double V = I * 0.7310585786300049 + 1.0 / (I + 1);
+    switch (I % 4) {
+    case 0:
+      snprintf(Buf, sizeof(Buf), "%u", I);
+      break;
+    case 1:
+      snprintf(Buf, sizeof(Buf), "%.17g", V);
+      break;
+    case 2:
+      snprintf(Buf, sizeof(Buf), "%.6e", V);
+      break;
+    case 3:
+      snprintf(Buf, sizeof(Buf), "%a", V);
+      break;
+    }
+    S += Buf;
+    S += I % 8 == 7 ? '\n' : ' ';
+  }
+  return S;
+}
+
+static void runNumberBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  // The edge cases first: what the first token of each lexes to, with NaN for
+  // a literal that must be rejected.
+  static const struct {
+    const char *Text;
+    double Val;
+  } Checks[] = {{"0x1.8p1", 3.0}, {"0x", NAN},        {"0x.p1", NAN},
+                {"1.2.3", NAN},   {"2e", 2.0},       {".5e1", 5.0},
+                {"1e-400", 0.0},  {"4e-320", 4e-320}, {"0x1p-1080", 0.0},
+                {"1e400", NAN},   {"0x1p1024", NAN}};
+  for (const auto &C : Checks) {
+    SymbolTable Symbols;
+    std::string Diagnostic;
+    Lexer Lex(Symbols, MemoryBuffer::getMemBuffer(C.Text, "<check>"));
+    Lex.setDiagnostic(&Diagnostic);
+    int Tok = Lex.gettok();
+    bool OK = std::isnan(C.Val) ? Tok == tok_error
+                                : Tok == tok_number && Lex.getNumVal() == C.Val;
+    if (!OK)
+      fprintf(stderr, "numbers: '%s' lexed as token %d, %g%s%s\n", C.Text,
+              Tok, Lex.getNumVal(), Diagnostic.empty() ? "" : ": ",
+              Diagnostic.c_str());
+  }
+
+  auto Input = takeBenchInput(File, [] { return generateNumberInput(1000000); });
+  StringRef Text = Input->getBuffer();
+
+  // The lexer as it is now: from_chars straight out of the buffer.
+  size_t Count = 0;
+  double Sum = 0;
+  double FromChars = timeSeconds([&] {
+    SymbolTable Symbols;
+    Lexer Lex(Symbols, MemoryBuffer::getMemBuffer(Text, "<bench>"));
+    for (int Tok = Lex.gettok(); Tok != tok_eof; Tok = Lex.gettok())
+      if (Tok == tok_number) {
+        ++Count;
+        Sum += Lex.getNumVal();
+      }
+  });
+
+  // What it used to do: copy each literal into a std::string and strtod it.
+  size_t StrtodCount = 0;
+  double StrtodSum = 0;
+  double Strtod = timeSeconds([&] {
+    for (const char *P = Text.begin(), *E = Text.end(); P != E;) {
+      while (P != E && isSpaceChar(*P))
+        ++P;
+      const char *Start = P;
+      while (P != E && !isSpaceChar(*P))
+        ++P;
+      if (Start == P)
+        break;
+      std::string NumStr(Start, P);
+      StrtodSum += strtod(NumStr.c_str(), nullptr);
+      ++StrtodCount;
+    }
+  });
+
+  fprintf(stderr, "numbers from_chars: %zu literals in %.3fs (%.1f ns each)\n",
+          Count, FromChars, FromChars * 1e9 / Count);
+  fprintf(stderr, "numbers strtod:     %zu literals in %.3fs (%.1f ns each)\n",
+          StrtodCount, Strtod, Strtod * 1e9 / StrtodCount);
+  if (Count != StrtodCount || Sum != StrtodSum)
+    fprintf(stderr, "numbers: results differ (sum %g vs %g)\n", Sum,
+            StrtodSum);
+}
+
+/// parseAll - Parse every top-level item without generating code, passing
+/// each function to OnFunction.  Returns the number that parsed successfully.
+template <typename Fn> static size_t parseAll(Parser &P, Fn OnFunction) {
+  size_t NumParsed = 0;
+  P.getNextToken();
+  while (true) {
+    bool Parsed;
+    switch (P.getCurTok()) {
+    case tok_eof:
+      return NumParsed;
+    case ';':
+      P.getNextToken();
+      continue;
+    case tok_extern:
+      Parsed = P.ParseExtern() != nullptr;
+      break;
+    default: {
+      auto FnAST = P.getCurTok() == tok_def ? P.ParseDefinition()
+                                            : P.ParseTopLevelExpr();
+      if ((Parsed = FnAST != nullptr))
+        OnFunction(*FnAST);
+      break;
+    }
+    }
+    if (Parsed)
+      ++NumParsed;
+    else
+      P.getNextToken(); // Skip token for error recovery.
+  }
+}
+
+static void runTokenizeBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] { return generateLexInput(16 << 20); });
+  StringRef Text = Input->getBuffer();
+  double MB = Text.size() / (1024.0 * 1024.0);
+
+  SymbolTable Symbols;
+  std::unique_ptr<TokenBuffer> Toks;
+  double Tokenize = timeSeconds([&] {
+    Toks = std::make_unique<TokenBuffer>(
+        Symbols, MemoryBuffer::getMemBuffer(Text, "<bench>"));
+  });
+  size_t FromTokens = 0;
+  double ParseTokens = timeSeconds([&] {
+    Parser P(*Toks);
+    FromTokens = parseAll(P, [](FunctionAST &) {});
+  });
+  size_t FromLexer = 0;
+  double ParseLexer = timeSeconds([&] {
+    Lexer Lex(Symbols, MemoryBuffer::getMemBuffer(Text, "<bench>"));
+    Parser P(Lex);
+    FromLexer = parseAll(P, [](FunctionAST &) {});
+  });
+
+  fprintf(stderr, "tokenize:           %.3fs, %.1f MB/s, %zu tokens\n",
+          Tokenize, MB / Tokenize, Toks->size());
+  fprintf(stderr, "parse from tokens:  %.3fs (%zu items)\n", ParseTokens,
+          FromTokens);
+  fprintf(stderr, "lex+parse together: %.3fs (%zu items)\n", ParseLexer,
+          FromLexer);
+}
+
+/// generateExprInput - Functions whose bodies are long arithmetic
+/// expressions over their arguments, with calls and conditionals mixed in.
+static std::string generateExprInput(unsigned NumFuncs, unsigned NumTerms) {
+  std::string S;
+  for (unsigned F = 0; F != NumFuncs; ++F) {
+    S += "def f" + std::to_string(F) + "(a b c)\n  ";
+    for (unsigned T = 0; T != NumTerms; ++T) {
+      if (T)
+        S += T % 3 ? " + " : " - ";
+      switch (T % 4) {
+      case 0:
+        S += "a*b*" + std::to_string(T);
+        break;
+      case 1:
+        S += "(c - a)*(b + " + std::to_string(T) + ")";
+        break;
+      case 2:
+        S += F ? "f" + std::to_string(F - 1) + "(a, b, c*2)" : "c";
+        break;
+      case 3:
+        S += "(if a < b then a else b*c)";
+        break;
+      }
+    }
+    S += ";\n";
+  }
+  return S;
+}
+
+static void runParseBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input =
+      takeBenchInput(File, [] { return generateExprInput(1000, 500); });
+  SymbolTable Symbols;
+  TokenBuffer Toks(Symbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  size_t NumItems = 0, NumNodes = 0, NumSlabs = 0, Bytes = 0;
+  double Parse = timeSeconds([&] {
+    Parser P(Toks);
+    NumItems = parseAll(P, [&](FunctionAST &F) {
+      NumNodes += F.getArena().getNumNodes();
+      NumSlabs += F.getArena().getNumSlabs();
+      Bytes += F.getArena().getBytesAllocated();
+    });
+  });
+
+  fprintf(stderr, "parse: %zu items, %zu nodes in %.3fs (%.1f ns/node)\n",
+          NumItems, NumNodes, Parse, Parse * 1e9 / NumNodes);
+  fprintf(stderr, "arena: %zu slabs, %.1f MB of nodes\n", NumSlabs,
+          Bytes / (1024.0 * 1024.0));
+}
 
+/// codegenAll - Generate IR for every function into one module, without
+/// running any passes.  Returns the elapsed time.
+static double codegenAll(std::vector<std::unique_ptr<FunctionAST>> &Fns) {
+  // The previous module, if any, was never handed to the JIT; drop it before
+  // its context goes away.
+  TheModule.reset();
   InitializeModuleAndPassManager();
+  TheOptimizer.reset();
+  FunctionProtos.clear();
+  return timeSeconds([&] {
+    for (auto &F : Fns)
+      F->codegen();
+  });
+}
+
+static void runFlatBenchmark() {
+  std::string Input = generateExprInput(1000, 500);
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input));
+  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+
+  // Every item in the generated input is a ';'-terminated definition.
+  std::vector<std::unique_ptr<FunctionAST>> Trees, Flats;
+  size_t TreeBytes = 0, FlatBytes = 0, NumNodes = 0;
+  for (auto *Fns : {&Trees, &Flats}) {
+    Parser P(Toks);
+    P.getNextToken();
+    while (P.getCurTok() == tok_def) {
+      Fns->push_back(P.ParseDefinition());
+      P.getNextToken(); // eat ';'.
+    }
+  }
+  for (auto &F : Trees) {
+    TreeBytes += F->getArena().getBytesAllocated();
+    NumNodes += F->getArena().getNumNodes();
+  }
+  double Flatten = timeSeconds([&] {
+    for (auto &F : Flats)
+      F->flattenBody();
+  });
+  for (auto &F : Flats)
+    FlatBytes += F->getFlatBody()->getMemoryUsage();
+
+  double TreeCodegen = codegenAll(Trees);
+  double FlatCodegen = codegenAll(Flats);
+
+  fprintf(stderr, "flat: %zu functions, %zu nodes\n", Trees.size(), NumNodes);
+  fprintf(stderr, "tree: %8.1f MB, codegen %.3fs\n",
+          TreeBytes / (1024.0 * 1024.0), TreeCodegen);
+  fprintf(stderr, "flat: %8.1f MB, codegen %.3fs (flattening %.3fs)\n",
+          FlatBytes / (1024.0 * 1024.0), FlatCodegen, Flatten);
+}
+
+static void runParallelParseBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input =
+      takeBenchInput(File, [] { return generateExprInput(10000, 50); });
+  StringRef Text = Input->getBuffer();
+
+  // -parse-jobs=1 is the default; compare against every core in that case.
+  // Each run interns into a new table, as a fresh process would.
+  unsigned Jobs = ParseJobs == 1 ? 0 : ParseJobs;
+  unsigned Threads = hardware_concurrency(Jobs).compute_thread_count();
+  struct Run {
+    SymbolTable Symbols;
+    std::unique_ptr<TokenBuffer> Toks;
+    size_t NumDefs = 0;
+    double LexSeconds = 0, ParseSeconds = 0;
+  };
+  auto RunWith = [&](Run &R, unsigned N) {
+    R.LexSeconds = timeSeconds([&] {
+      R.Toks = std::make_unique<TokenBuffer>(
+          R.Symbols, MemoryBuffer::getMemBuffer(Text, "<bench>"), N);
+    });
+    R.ParseSeconds = timeSeconds(
+        [&] { R.NumDefs = DefinitionPrepass(*R.Toks, N).getNumDefinitions(); });
+  };
+  Run Warm, Serial;
+  RunWith(Warm, 1);
+  RunWith(Serial, 1);
+
+  fprintf(stderr, "parallel-parse: %zu definitions, %zu tokens, %u cores\n",
+          Serial.NumDefs, Serial.Toks->size(),
+          hardware_concurrency().compute_thread_count());
+  auto Print = [&](unsigned N, const Run &R) {
+    double Base = Serial.LexSeconds + Serial.ParseSeconds;
+    double Total = R.LexSeconds + R.ParseSeconds;
+    fprintf(stderr, "%2u thread%s lex %.3fs, parse %.3fs, total %.3fs "
+            "(%.2fx)\n",
+            N, N == 1 ? ": " : "s:", R.LexSeconds, R.ParseSeconds, Total,
+            Base / Total);
+  };
+  Print(1, Serial);
+  if (Threads == 1) {
+    fprintf(stderr,
+            "(one core; pass -parse-jobs=N to time N threads on it)\n");
+    return;
+  }
+
+  // The tokens, SymbolIDs and diagnostics must not depend on the threads.
+  Run Parallel;
+  RunWith(Parallel, Jobs);
+  Print(Threads, Parallel);
+  bool Same = Serial.Toks->size() == Parallel.Toks->size() &&
+              Serial.Symbols.size() == Parallel.Symbols.size();
+  for (size_t I = 0, E = Serial.Toks->size(); Same && I != E; ++I) {
+    const std::string *SD = Serial.Toks->getDiagnostic(I);
+    const std::string *PD = Parallel.Toks->getDiagnostic(I);
+    Same = Serial.Toks->getKind(I) == Parallel.Toks->getKind(I) &&
+           Serial.Toks->getText(I) == Parallel.Toks->getText(I) &&
+           (Serial.Toks->getKind(I) != tok_identifier
+                ? Serial.Toks->getKind(I) != tok_number ||
+                      Serial.Toks->getNumVal(I) == Parallel.Toks->getNumVal(I)
+                : Serial.Toks->getSymbol(I) == Parallel.Toks->getSymbol(I)) &&
+           !SD == !PD && (!SD || *SD == *PD);
+  }
+  if (!Same)
+    fprintf(stderr, "parallel-parse: tokens differ\n");
+}
+
+/// generateDeepInput - Three definitions nested Depth levels deep: a chain of
+/// operators (a left-leaning tree), nested parentheses (a right-leaning one)
+/// and an else-if ladder.
+static std::string generateDeepInput(unsigned Depth) {
+  std::string S = "def chain(x) x";
+  for (unsigned I = 0; I != Depth; ++I)
+    S += I % 2 ? " - 1" : " + 2";
+  S += ";\ndef parens(x) ";
+  S.append(Depth, '(');
+  S += "x";
+  for (unsigned I = 0; I != Depth; ++I)
+    S += I % 2 ? " * 1)" : " + 1)";
+  S += ";\ndef ladder(x) ";
+  for (unsigned I = 0; I != Depth; ++I)
+    S += "if x < " + std::to_string(I) + " then " + std::to_string(I) +
+         " else ";
+  S += "0;\n";
+  return S;
+}
+
+static void runDeepBenchmark() {
+  // Run on a thread with a stack far too small for a recursive walk of any
+  // of these, to show that the parser and codegen don't grow it.
+  constexpr unsigned StackSize = 256 << 10;
+  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+  fprintf(stderr, "deep: %u KB stack\n", StackSize >> 10);
+  for (unsigned Depth : {12500, 25000, 50000, 100000, 200000}) {
+    std::string Input = generateDeepInput(Depth);
+    TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input));
+    CrashRecoveryContext().RunSafelyOnThread([&] {
+      std::vector<std::unique_ptr<FunctionAST>> Fns;
+      double Parse = timeSeconds([&] {
+        Parser P(Toks);
+        P.getNextToken();
+        while (P.getCurTok() == tok_def) {
+          Fns.push_back(P.ParseDefinition());
+          P.getNextToken(); // eat ';'.
+        }
+      });
+      size_t NumNodes = 0;
+      for (auto &F : Fns)
+        NumNodes += F->getArena().getNumNodes();
+      double Codegen = codegenAll(Fns);
+      fprintf(stderr,
+              "depth %6u: %7zu nodes, parse %.3fs (%.0f ns/node), "
+              "codegen %.3fs (%.0f ns/node)\n",
+              Depth, NumNodes, Parse, Parse * 1e9 / NumNodes, Codegen,
+              Codegen * 1e9 / NumNodes);
+    }, StackSize);
+  }
+}
+
+/// generateFoldInput - A helper function followed by NumExprs top-level
+/// expressions that are mostly constant arithmetic.
+static std::string generateFoldInput(unsigned NumExprs) {
+  std::string S = "def k(x) x * 1 + 0;\n";
+  for (unsigned I = 0; I != NumExprs; ++I) {
+    std::string N = std::to_string(I);
+    S += "(" + N + " + 1) * 2 - (3 * 4 - " + N + ") * 1 + k(" + N +
+         " + 2 * 3) + (if 2 < 1 then k(0) else (5 + " + N +
+         ") * 0.5) - k(" + N + ") * (2 - 1) + 0 * k(1);\n";
+  }
+  return S;
+}
+
+static void runFoldBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] { return generateFoldInput(5000); });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+
+  // Compile every item, each into its own module as the driver does, and
+  // count the instructions of the top-level expressions.  Only simplifying
+  // and codegen (including the function passes, if Optimize) are timed.
+  auto CompileAll = [&](FoldMode Mode, bool Optimize, size_t &NumExprs,
+                        size_t &NumInsts) {
+    NumExprs = NumInsts = 0;
+    double Seconds = 0;
+    Parser P(Toks);
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof) {
+      if (P.getCurTok() == ';') {
+        P.getNextToken();
+        continue;
+      }
+      bool IsDef = P.getCurTok() == tok_def;
+      auto F = IsDef ? P.ParseDefinition() : P.ParseTopLevelExpr();
+      if (!F) {
+        P.getNextToken();
+        continue;
+      }
+      TheModule.reset();
+      InitializeModuleAndPassManager();
+      if (!Optimize)
+        TheOptimizer.reset();
+      Function *FnIR = nullptr;
+      Seconds += timeSeconds([&] {
+        F->simplifyBody(Mode);
+        FnIR = F->codegen();
+      });
+      if (FnIR && !IsDef) {
+        ++NumExprs;
+        NumInsts += FnIR->getInstructionCount();
+      }
+    }
+    return Seconds;
+  };
+
+  // Whether each mode still reports what codegen would in an untaken arm.
+  const char *Names[] = {"none", "strict", "fast"};
+  for (FoldMode Mode : {FoldMode::None, FoldMode::Strict, FoldMode::Fast}) {
+    TokenBuffer Check(TheSymbols, MemoryBuffer::getMemBuffer(
+                                      "if 1 then 2 else nosuch;", "<check>"));
+    Parser P(Check);
+    P.getNextToken();
+    auto F = P.ParseTopLevelExpr();
+    TheModule.reset();
+    InitializeModuleAndPassManager();
+    F->simplifyBody(Mode);
+    if (F->codegen())
+      fprintf(stderr, "fold=%-6s drops the unknown variable in an untaken "
+                      "arm%s\n",
+              Names[(int)Mode],
+              Mode == FoldMode::None ? ", which codegen must report" : "");
+  }
+
+  for (FoldMode Mode : {FoldMode::None, FoldMode::Strict, FoldMode::Fast}) {
+    size_t NumExprs, Emitted, Optimized;
+    CompileAll(Mode, /*Optimize=*/false, NumExprs, Emitted);
+    double Seconds = CompileAll(Mode, /*Optimize=*/true, NumExprs, Optimized);
+    fprintf(stderr,
+            "fold=%-6s %zu expressions in %.3fs, instructions per expression: "
+            "%.1f emitted, %.1f optimized\n",
+            Names[(int)Mode], NumExprs, Seconds, (double)Emitted / NumExprs,
+            (double)Optimized / NumExprs);
+  }
+}
+
+/// generateShareInput - NumDefs definitions in the style of generated scripts:
+/// the same few subexpressions of the parameters, repeated within and across
+/// functions around calls to the previous definition.
+static std::string generateShareInput(unsigned NumDefs) {
+  std::string S = "def f0(x y) x + y;\n";
+  for (unsigned I = 1; I != NumDefs; ++I) {
+    std::string Prev = "f" + std::to_string(I - 1);
+    std::string K = std::to_string(I % 16);
+    S += "def f" + std::to_string(I) + "(x y) (x*x + y*y) * (x - " + K +
+         ") + " + Prev + "(x*x + y*y, y - " + K + ") + (if x < y then (x*x + " +
+         "y*y) * 0.5 else (x - " + K + ") * (y - " + K + ")) + (x*x + y*y) * " +
+         "(1 + (x - " + K + ") * (x - " + K + "));\n";
+  }
+  return S;
+}
+
+static void runShareBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] { return generateShareInput(5000); });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+
+  // Compile every definition into its own module and keep its AST, as
+  // -incremental and -tiered do.  Only sharing and codegen (including the
+  // function passes, if Optimize) are timed.  A definition that fails to
+  // parse, or that the parser stops short of the end of, isn't compiled, and
+  // is counted so that a malformed input can't pass for a smaller one.
+  auto CompileAll = [&](bool Share, bool Optimize, size_t &Bytes,
+                        size_t &NumInsts, unsigned &NumFailed) {
+    SharedExprTable Table;
+    std::vector<std::unique_ptr<FunctionAST>> Defs;
+    NumInsts = 0;
+    NumFailed = 0;
+    double Seconds = 0;
+    Parser P(Toks);
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof) {
+      if (P.getCurTok() == ';') {
+        P.getNextToken();
+        continue;
+      }
+      auto F = P.getCurTok() == tok_def ? P.ParseDefinition() : nullptr;
+      if (!F || (P.getCurTok() != ';' && P.getCurTok() != tok_def &&
+                 P.getCurTok() != tok_eof)) {
+        ++NumFailed;
+        while (P.getCurTok() != tok_def && P.getCurTok() != tok_eof)
+          P.getNextToken();
+        continue;
+      }
+      F->simplifyBody(Fold);
+      TheModule.reset();
+      InitializeModuleAndPassManager();
+      if (!Optimize)
+        TheOptimizer.reset();
+      Function *FnIR = nullptr;
+      Seconds += timeSeconds([&] {
+        if (Share)
+          F->shareBody(Table);
+        FnIR = F->codegen();
+      });
+      if (FnIR)
+        NumInsts += FnIR->getInstructionCount();
+      Defs.push_back(std::move(F));
+    }
+    Bytes = Table.getBytesAllocated();
+    for (auto &F : Defs)
+      Bytes += F->getArena().getBytesAllocated();
+    if (Share && Optimize)
+      fprintf(stderr, "%zu pure nodes interned as %zu distinct ones\n",
+              Table.getNumLookups(), Table.getNumNodes());
+    return Seconds;
+  };
+
+  for (bool Share : {false, true}) {
+    size_t Bytes, Emitted, Optimized;
+    unsigned NumFailed;
+    CompileAll(Share, /*Optimize=*/false, Bytes, Emitted, NumFailed);
+    double Seconds =
+        CompileAll(Share, /*Optimize=*/true, Bytes, Optimized, NumFailed);
+    if (NumFailed)
+      fprintf(stderr, "skipped %u input items that failed to parse\n",
+              NumFailed);
+    fprintf(stderr,
+            "%-9s %.1f MB of AST kept, %zu instructions emitted, %zu "
+            "optimized, %.3fs\n",
+            Share ? "shared" : "unshared", Bytes / 1e6, Emitted, Optimized,
+            Seconds);
+  }
+}
+
+/// flattenBySwitch - flattenExpr as it was before ExprWalker: the same
+/// explicit-stack walk written out with a switch.  For -bench=visit only.
+static FlatAST::NodeIdx flattenBySwitch(const ExprAST *Root, FlatAST &F) {
+  using NodeIdx = FlatAST::NodeIdx;
+  TreeView View;
+  struct Frame {
+    const ExprAST *E;
+    unsigned NextOp;
+  };
+  SmallVector<Frame, 32> Stack = {{Root, 0}};
+  SmallVector<NodeIdx, 32> Done;
+  while (!Stack.empty()) {
+    Frame &Fr = Stack.back();
+    const ExprAST *E = Fr.E;
+    unsigned NumOps = View.getNumOperands(E);
+    if (Fr.NextOp != NumOps) {
+      if (const ExprAST *Op = View.getOperand(E, Fr.NextOp++))
+        Stack.push_back({Op, 0});
+      else
+        Done.push_back(FlatAST::NoNode);
+      continue;
+    }
+
+    ArrayRef<NodeIdx> Ops = ArrayRef<NodeIdx>(Done).take_back(NumOps);
+    NodeIdx N = FlatAST::NoNode;
+    switch (E->getKind()) {
+    case ExprKind::Number:
+      N = F.addNumber(View.getNumVal(E));
+      break;
+    case ExprKind::Variable:
+      N = F.addNode(ExprKind::Variable, View.getSymbol(E));
+      break;
+    case ExprKind::Binary:
+      N = F.addNode(ExprKind::Binary, Ops[0], Ops[1], 0, View.getOp(E));
+      break;
+    case ExprKind::Call:
+      N = F.addNode(ExprKind::Call, View.getSymbol(E), F.addExtra(Ops), NumOps);
+      break;
+    case ExprKind::If:
+      N = F.addNode(ExprKind::If, Ops[0], Ops[1], Ops[2]);
+      break;
+    case ExprKind::For:
+      N = F.addNode(ExprKind::For, View.getSymbol(E), F.addExtra(Ops));
+      break;
+    }
+    Done.resize(Done.size() - NumOps);
+    Done.push_back(N);
+    Stack.pop_back();
+  }
+  return Done.back();
+}
+
+/// simplifyBySwitch - simplifyExpr as it was before ExprWalker.  For
+/// -bench=visit only.
+static const ExprAST *simplifyBySwitch(const ExprAST *Root, ASTArena &A,
+                                       FoldMode Mode) {
+  TreeView View;
+  struct Frame {
+    const ExprAST *E;
+    unsigned NextOp;
+  };
+  SmallVector<Frame, 32> Stack = {{Root, 0}};
+  SmallVector<Simplified, 32> Done;
+  while (!Stack.empty()) {
+    Frame &Fr = Stack.back();
+    const ExprAST *E = Fr.E;
+    unsigned NumOps = View.getNumOperands(E);
+    if (Fr.NextOp != NumOps) {
+      if (const ExprAST *Op = View.getOperand(E, Fr.NextOp++))
+        Stack.push_back({Op, 0});
+      else
+        Done.push_back({nullptr, false});
+      continue;
+    }
+
+    ArrayRef<Simplified> Ops = ArrayRef<Simplified>(Done).take_back(NumOps);
+    bool Changed = false, HasEffects = false;
+    for (unsigned I = 0; I != NumOps; ++I) {
+      Changed |= Ops[I].E != View.getOperand(E, I);
+      HasEffects |= Ops[I].HasEffects;
+    }
+
+    Simplified Result = {E, HasEffects};
+    switch (E->getKind()) {
+    case ExprKind::Number:
+    case ExprKind::Variable:
+      break;
+    case ExprKind::Binary: {
+      char Op = View.getOp(E);
+      Result = simplifyBinary(Op, Ops[0], Ops[1], Mode, A);
+      if (!Result.E)
+        Result = {Changed ? A.make<BinaryExprAST>(Op, Ops[0].E, Ops[1].E) : E,
+                  HasEffects};
+      break;
+    }
+    case ExprKind::Call:
+      if (Changed) {
+        SmallVector<const ExprAST *, 8> Args;
+        for (const Simplified &Arg : Ops)
+          Args.push_back(Arg.E);
+        Result.E = A.make<CallExprAST>(View.getSymbol(E), A.copyArray(
+                                           ArrayRef<const ExprAST *>(Args)));
+      }
+      Result.HasEffects = true;
+      break;
+    case ExprKind::If:
+      if (auto *C = dyn_cast<NumberExprAST>(Ops[0].E))
+        Result = C->getVal() != 0.0 && !std::isnan(C->getVal()) ? Ops[1]
+                                                                : Ops[2];
+      else if (Changed)
+        Result.E = A.make<IfExprAST>(Ops[0].E, Ops[1].E, Ops[2].E);
+      break;
+    case ExprKind::For:
+      if (Changed)
+        Result.E = A.make<ForExprAST>(View.getSymbol(E), Ops[0].E, Ops[1].E,
+                                      Ops[2].E, Ops[3].E);
+      Result.HasEffects = true;
+      break;
+    }
+    Done.resize(Done.size() - NumOps);
+    Done.push_back(Result);
+    Stack.pop_back();
+  }
+  return Done.back().E;
+}
+
+static void runVisitBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input =
+      takeBenchInput(File, [] { return generateExprInput(1000, 500); });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+  std::vector<std::unique_ptr<FunctionAST>> Fns;
+  size_t NumNodes = 0;
+  Parser P(Toks);
+  P.getNextToken();
+  while (P.getCurTok() != tok_eof) {
+    if (P.getCurTok() != tok_def) {
+      P.getNextToken();
+      continue;
+    }
+    if (auto F = P.ParseDefinition()) {
+      NumNodes += F->getArena().getNumNodes();
+      Fns.push_back(std::move(F));
+    }
+  }
+
+  // Each pass runs over every body a few times, through ExprWalker and
+  // through the switch it replaced.  The results are hashed so that neither
+  // version can be optimized away, and so that they can be compared.
+  const unsigned Rounds = 5;
+  auto Run = [&](const char *Name, auto Walker, auto Switch) {
+    hash_code WalkerSum = hash_value(0), SwitchSum = hash_value(0);
+    double WalkerSeconds = timeSeconds([&] {
+      for (unsigned I = 0; I != Rounds; ++I)
+        for (auto &F : Fns)
+          WalkerSum = hash_combine(WalkerSum, Walker(F->getBody()));
+    });
+    double SwitchSeconds = timeSeconds([&] {
+      for (unsigned I = 0; I != Rounds; ++I)
+        for (auto &F : Fns)
+          SwitchSum = hash_combine(SwitchSum, Switch(F->getBody()));
+    });
+    fprintf(stderr,
+            "%-8s ExprWalker %.3fs (%.1f ns/node), switch %.3fs (%.1f "
+            "ns/node), %.2fx%s\n",
+            Name, WalkerSeconds, WalkerSeconds * 1e9 / (NumNodes * Rounds),
+            SwitchSeconds, SwitchSeconds * 1e9 / (NumNodes * Rounds),
+            SwitchSeconds / WalkerSeconds,
+            WalkerSum == SwitchSum ? "" : " MISMATCH");
+  };
+
+  fprintf(stderr, "visit: %zu functions, %zu nodes\n", Fns.size(), NumNodes);
+  auto Flatten = [](auto Walk) {
+    return [Walk](const ExprAST *Body) {
+      FlatAST F;
+      F.setRoot(Walk(Body, F));
+      return ExprHasher<FlatView>(FlatView{F}).walk(F.getRoot());
+    };
+  };
+  Run("flatten", Flatten(flattenExpr), Flatten(flattenBySwitch));
+
+  auto Simplify = [](auto Walk) {
+    return [Walk](const ExprAST *Body) {
+      ASTArena A;
+      return ExprHasher<TreeView>(TreeView())
+          .walk(Walk(Body, A, FoldMode::Fast));
+    };
+  };
+  Run("simplify", Simplify(simplifyExpr), Simplify(simplifyBySwitch));
+}
+
+namespace {
+
+/// ProgramRun - What runProgram measured of one run of a program.
+struct ProgramRun {
+  double Sum = 0;
+  /// Time spent compiling the definitions, through to machine code.
+  double CompileSeconds = 0;
+  /// Time spent evaluating each top-level expression, in order.
+  std::vector<double> ExprSeconds;
+};
+
+/// ProgramHooks - How runProgram runs a program, where benchmarks differ.
+struct ProgramHooks {
+  EngineKind Engine = EngineKind::JIT;
+  /// Sets the options for the run, before the JIT or VM is reset.
+  std::function<void()> Setup;
+  /// Sees each definition's module, optimized, before the JIT gets it.
+  std::function<void(Module &)> OnModule;
+  /// Takes each top-level expression instead of it being evaluated.
+  std::function<void(std::unique_ptr<FunctionAST>)> OnExpr;
+};
+
+} // end anonymous namespace
+
+/// runProgram - Run the program in Toks quietly, starting from an empty JIT
+/// or VM.  With the JIT, each definition goes into a module of its own and is
+/// compiled to machine code at once, instead of at its first call, so that
+/// compiling and evaluating are timed apart.
+static ProgramRun runProgram(const TokenBuffer &Toks,
+                             const ProgramHooks &Hooks = {}) {
+  if (Hooks.Setup)
+    Hooks.Setup();
+  FunctionProtos.clear();
+  TheVM.reset();
+  bool UseJIT = Hooks.Engine == EngineKind::JIT;
+  if (UseJIT) {
+    SavedDefinitions.clear();
+    TheOptimizer.reset();
+    TheModule.reset();
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    InitializeModuleAndPassManager();
+  }
+
+  ProgramRun Run;
+  Parser P(Toks);
+  P.getNextToken();
+  while (P.getCurTok() != tok_eof) {
+    switch (P.getCurTok()) {
+    case ';':
+      P.getNextToken();
+      break;
+    case tok_extern:
+      if (auto Proto = P.ParseExtern()) {
+        if (UseJIT)
+          Proto->codegen();
+        FunctionProtos[Proto->getName()] = std::move(Proto);
+      }
+      break;
+    case tok_def:
+      if (auto F = P.ParseDefinition()) {
+        prepareBody(*F);
+        Run.CompileSeconds += timeSeconds([&] {
+          if (!UseJIT) {
+            TheVM.define(*F);
+            return;
+          }
+          if (!F->codegen())
+            return;
+          ThreadSafeModule TSM = takeModule();
+          if (Hooks.OnModule)
+            Hooks.OnModule(*TSM.getModuleUnlocked());
+          ExitOnErr(TheJIT->addModule(std::move(TSM)));
+          InitializeModuleAndPassManager();
+          ExitOnErr(TheJIT->lookup(TheSymbols.getName(F->getName())));
+        });
+      }
+      break;
+    default:
+      if (auto F = P.ParseTopLevelExpr()) {
+        prepareBody(*F);
+        if (Hooks.OnExpr) {
+          Hooks.OnExpr(std::move(F));
+          break;
+        }
+        double Result;
+        Run.ExprSeconds.push_back(timeSeconds([&] {
+          if (UseJIT ? EvaluateWithJIT(*F, Result)
+                     : TheVM.evaluate(*F, Result))
+            Run.Sum += Result;
+        }));
+      } else {
+        P.getNextToken();
+      }
+      break;
+    }
+  }
+  return Run;
+}
+
+/// countInstructions - A ProgramHooks::OnModule that adds up the instructions
+/// of the modules, or with OnlyCalls just the calls, into Count.
+static std::function<void(Module &)> countInstructions(size_t &Count,
+                                                       bool OnlyCalls = false) {
+  Count = 0;
+  return [&Count, OnlyCalls](Module &M) {
+    for (Function &F : M)
+      for (Instruction &I : instructions(F))
+        Count += !OnlyCalls || isa<CallInst>(I);
+  };
+}
+
+/// printExprSeconds - Finish a benchmark's line with each expression's time
+/// and the sum of the results.
+static void printExprSeconds(const ProgramRun &Run) {
+  for (double T : Run.ExprSeconds)
+    fprintf(stderr, " %.3fs", T);
+  fprintf(stderr, ", sum %g\n", Run.Sum);
+}
+
+/// generateLoopsInput - Nested counting loops, and a loop around a call with
+/// loop-invariant arguments.
+static std::string generateLoopsInput() {
+  return "def cube(n) for i = 0, i < n in for j = 0, j < n in\n"
+         "  for k = 0, k < n in 0;\n"
+         "def cube600() for i = 0, i < 600 in for j = 0, j < 600 in\n"
+         "  for k = 0, k < 600 in 0;\n"
+         "def triangle(n) for i = 1, i < n in for j = 1, j < i, 2 in 0;\n"
+         "def id(x) x;\n"
+         "def poly(n) for i = 0, i < 20000000 in\n"
+         "  id((n * n + 1) * (n * n + 2) * (n * n + 3) * (n * n + 4) + i);\n"
+         "cube(600);\n"
+         "cube600();\n"
+         "triangle(30000);\n"
+         "poly(3);\n";
+}
+
+static void runLoopsBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, generateLoopsInput);
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  struct Mode {
+    const char *Name;
+    bool IntIVs, Loops;
+  } Modes[] = {{"double:", false, false},
+               {"i64:", true, false},
+               {"double, -loop-opts:", false, true},
+               {"i64, -loop-opts:", true, true}};
+  for (const Mode &M : Modes) {
+    size_t NumInsts;
+    ProgramHooks Hooks;
+    Hooks.Setup = [&] {
+      IntegerIVs = M.IntIVs;
+      LoopOpts = M.Loops;
+    };
+    Hooks.OnModule = countInstructions(NumInsts);
+    ProgramRun Run = runProgram(Toks, Hooks);
+    fprintf(stderr, "%-20s %zu instructions in the definitions, loops ran in",
+            M.Name, NumInsts);
+    printExprSeconds(Run);
+  }
+}
+
+static void runOptBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(
+      File, [] { return generateExprInput(300, 24) + generateLoopsInput(); });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  struct Mode {
+    const char *Name;
+    PipelineKind Level;
+    PipelineScope Scope;
+  } Modes[] = {{"tutorial:", PipelineKind::Tutorial, PipelineScope::Function},
+               {"-O0:", PipelineKind::O0, PipelineScope::Function},
+               {"-O1:", PipelineKind::O1, PipelineScope::Function},
+               {"-O2:", PipelineKind::O2, PipelineScope::Function},
+               {"-O3:", PipelineKind::O3, PipelineScope::Function},
+               {"-Os:", PipelineKind::Os, PipelineScope::Function},
+               {"-O3, module:", PipelineKind::O3, PipelineScope::Module}};
+  for (const Mode &M : Modes) {
+    size_t NumInsts;
+    ProgramHooks Hooks;
+    Hooks.Setup = [&] {
+      OptLevel = M.Level;
+      OptScope = M.Scope;
+    };
+    Hooks.OnModule = countInstructions(NumInsts);
+    ProgramRun Run = runProgram(Toks, Hooks);
+    double RunSeconds = 0;
+    for (double T : Run.ExprSeconds)
+      RunSeconds += T;
+    fprintf(stderr, "%-13s %7zu instructions, compiled in %.3fs, ran in "
+            "%.3fs, sum %g\n",
+            M.Name, NumInsts, Run.CompileSeconds, RunSeconds, Run.Sum);
+  }
+}
+
+static void runFPModeBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  // Sums of like terms and constants, which fold only when they may be
+  // reassociated, called from a hot loop.
+  auto Input = takeBenchInput(File, [] {
+    return std::string(
+        "def poly(x) x*1.5 + 2 + x*x*0.5 + x*2.5 + 3 + x*x*1.25 + x*0.25 +\n"
+        "  4 + x*x*x*0.125 + x*x*0.75 + x*x*x*0.875 + x*3.5 + 5;\n"
+        "def mix(a b) (a + 1) * (b + 2) + (a + 3) * (b + 4) + a*b*6 +\n"
+        "  (a - b) * 2 + (b - a) * 2;\n"
+        "for i = 0, i < 20000000 in poly(i);\n"
+        "for i = 0, i < 20000000 in mix(i, 3);\n");
+  });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  struct Mode {
+    const char *Name;
+    FPMode FP;
+  } Modes[] = {{"strict:", FPMode::Strict},
+               {"contract:", FPMode::Contract},
+               {"reassoc:", FPMode::Reassoc},
+               {"fast:", FPMode::Fast}};
+  for (const Mode &M : Modes) {
+    size_t NumInsts;
+    ProgramHooks Hooks;
+    Hooks.Setup = [&] { FPModeOpt = M.FP; };
+    Hooks.OnModule = countInstructions(NumInsts);
+    ProgramRun Run = runProgram(Toks, Hooks);
+    fprintf(stderr, "%-9s %zu instructions in the definitions, ran in",
+            M.Name, NumInsts);
+    printExprSeconds(Run);
+  }
+}
+
+static void runInlineBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  // Chains of small helpers, each defined before its callers, and hot loops
+  // around the top of each chain.
+  auto Input = takeBenchInput(File, [] {
+    return std::string(
+        "def sq(x) x*x;\n"
+        "def lerp(a b t) a + (b - a) * t;\n"
+        "def clamp(x lo hi) if x < lo then lo else if hi < x then hi else x;\n"
+        "def smooth(t) sq(t) * (3 - 2*t);\n"
+        "def step(x) smooth(clamp(x * 0.001, 0, 1));\n"
+        "def blend(x) lerp(sq(x), x + 1, step(x));\n"
+        "def dist(x y) sq(x - y) + sq(y - x + 1);\n"
+        "def min(a b) if a < b then a else b;\n"
+        "def near(x) min(dist(x, 500), dist(x, 1500));\n"
+        "for i = 0, i < 20000000 in blend(i);\n"
+        "for i = 0, i < 20000000 in near(i);\n");
+  });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  // Count the calls left in the definitions once they are optimized.
+  for (bool Inline : {false, true}) {
+    size_t NumCalls;
+    ProgramHooks Hooks;
+    Hooks.Setup = [&] { InlineDefs = Inline; };
+    Hooks.OnModule = countInstructions(NumCalls, /*OnlyCalls=*/true);
+    ProgramRun Run = runProgram(Toks, Hooks);
+    fprintf(stderr, "%-15s %zu calls in the definitions, compiled in %.3fs, "
+            "ran in",
+            Inline ? "-inline-defs:" : "separate:", NumCalls,
+            Run.CompileSeconds);
+    printExprSeconds(Run);
+  }
+}
+
+static void runInterpretBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] { return generateFoldInput(2000); });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  // Compile the definitions, and keep the expressions to evaluate both ways.
+  std::vector<std::unique_ptr<FunctionAST>> Exprs;
+  ProgramHooks Hooks;
+  Hooks.OnExpr = [&](std::unique_ptr<FunctionAST> F) {
+    Exprs.push_back(std::move(F));
+  };
+  runProgram(Toks, Hooks);
+
+  for (InterpretPolicy Policy :
+       {InterpretPolicy::Never, InterpretPolicy::Always}) {
+    Interpret = Policy;
+    double Sum = 0;
+    double Seconds = timeSeconds([&] {
+      for (auto &F : Exprs) {
+        double Result;
+        if (Evaluate(*F, Result))
+          Sum += Result;
+      }
+    });
+    fprintf(stderr, "%-11s %zu expressions in %.3fs (%.1f us each), sum %g\n",
+            Policy == InterpretPolicy::Never ? "jit:" : "interpret:",
+            Exprs.size(), Seconds, Seconds * 1e6 / Exprs.size(), Sum);
+  }
+}
+
+static void runVMBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  // The tutorial's kinds of program: recursion, loops calling a function,
+  // and lots of one-off expressions.
+  std::vector<std::pair<std::string, std::string>> Programs;
+  if (File) {
+    Programs.push_back({"input", File->getBuffer().str()});
+  } else {
+    Programs.push_back(
+        {"fib", "def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);\n"
+                "fib(30);\n"});
+    Programs.push_back({"loops", "def mul(a b) a * b;\n"
+                                 "for i = 1, i < 1000 in\n"
+                                 "  for j = 1, j < 1000 in mul(i, j);\n"});
+    Programs.push_back({"oneshot", generateFoldInput(1000)});
+  }
+
+  for (auto &Program : Programs) {
+    double Sums[2];
+    double Seconds[2];
+    for (EngineKind E : {EngineKind::JIT, EngineKind::VM}) {
+      Seconds[(int)E] = timeSeconds([&] {
+        TokenBuffer Toks(TheSymbols,
+                         MemoryBuffer::getMemBuffer(Program.second));
+        ProgramHooks Hooks;
+        Hooks.Engine = E;
+        Sums[(int)E] = runProgram(Toks, Hooks).Sum;
+      });
+    }
+    size_t Bytes = TheVM.getMemoryUsage();
+    fprintf(stderr,
+            "%-8s jit: %.4fs  vm: %.4fs (%.1fx)  sums %g/%g, %zu bytes of "
+            "bytecode\n",
+            Program.first.c_str(), Seconds[0], Seconds[1],
+            Seconds[0] / Seconds[1], Sums[0], Sums[1], Bytes);
+  }
+}
+
+static void runOSRBenchmark(std::unique_ptr<MemoryBuffer> File) {
+  auto Input = takeBenchInput(File, [] {
+    return std::string("def sq(x) x * x;\n"
+                       "for i = 1, i < 3000000 in sq(i) - 3 * i + 1;\n");
+  });
+  TokenBuffer Toks(TheSymbols, MemoryBuffer::getMemBuffer(Input->getBuffer()));
+
+  // Compile the definitions, and keep the expressions to run each way.
+  std::vector<std::unique_ptr<FunctionAST>> Exprs;
+  ProgramHooks Hooks;
+  Hooks.OnExpr = [&](std::unique_ptr<FunctionAST> F) {
+    Exprs.push_back(std::move(F));
+  };
+  runProgram(Toks, Hooks);
+
+  struct Mode {
+    const char *Name;
+    InterpretPolicy Policy;
+    bool UseOSR;
+  } Modes[] = {{"jit:", InterpretPolicy::Never, false},
+               {"interpret:", InterpretPolicy::Always, false},
+               {"osr:", InterpretPolicy::Always, true}};
+  for (const Mode &M : Modes) {
+    Interpret = M.Policy;
+    OSR = M.UseOSR;
+    double Sum = 0;
+    double Seconds = timeSeconds([&] {
+      for (auto &F : Exprs) {
+        double Result;
+        if (Evaluate(*F, Result))
+          Sum += Result;
+      }
+    });
+    fprintf(stderr, "%-11s %zu expressions in %.3fs, sum %g\n", M.Name,
+            Exprs.size(), Seconds, Sum);
+  }
+}
+
+static int runBenchmark(std::unique_ptr<MemoryBuffer> Input) {
+  switch (Bench) {
+  case BenchNone:
+    break;
+  case BenchLex:
+    runLexBenchmark(std::move(Input));
+    break;
+  case BenchNumbers:
+    runNumberBenchmark(std::move(Input));
+    break;
+  case BenchTokenize:
+    runTokenizeBenchmark(std::move(Input));
+    break;
+  case BenchParse:
+    runParseBenchmark(std::move(Input));
+    break;
+  case BenchFlat:
+    runFlatBenchmark();
+    break;
+  case BenchParallelParse:
+    runParallelParseBenchmark(std::move(Input));
+    break;
+  case BenchDeep:
+    runDeepBenchmark();
+    break;
+  case BenchFold:
+    runFoldBenchmark(std::move(Input));
+    break;
+  case BenchInterpret:
+    runInterpretBenchmark(std::move(Input));
+    break;
+  case BenchVM:
+    runVMBenchmark(std::move(Input));
+    break;
+  case BenchOSR:
+    runOSRBenchmark(std::move(Input));
+    break;
+  case BenchShare:
+    runShareBenchmark(std::move(Input));
+    break;
+  case BenchVisit:
+    runVisitBenchmark(std::move(Input));
+    break;
+  case BenchLoops:
+    runLoopsBenchmark(std::move(Input));
+    break;
+  case BenchOpt:
+    runOptBenchmark(std::move(Input));
+    break;
+  case BenchFPMode:
+    runFPModeBenchmark(std::move(Input));
+    break;
+  case BenchInline:
+    runInlineBenchmark(std::move(Input));
+    break;
+  }
+  return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+                                           cl::desc("<input files>"));
+
+static cl::opt<bool>
+    PreTokenize("pretokenize",
+                cl::desc("Lex the whole input up front and parse from the "
+                         "token buffer"));
+
+/// RunScript - Run one input through the interpreter loop.  A null Input reads
+/// stdin.
+static void RunScript(std::unique_ptr<MemoryBuffer> Input) {
+  Lexer Lex(TheSymbols);
+  std::unique_ptr<TokenBuffer> Toks;
+  std::unique_ptr<Parser> P;
+  std::unique_ptr<DefinitionPrepass> Prepass;
+  if (PreTokenize || ParseJobs != 1 || Incremental) {
+    if (!Input)
+      Input = ExitOnErr(errorOrToExpected(MemoryBuffer::getSTDIN()));
+    Toks = std::make_unique<TokenBuffer>(TheSymbols, std::move(Input),
+                                         ParseJobs);
+    P = std::make_unique<Parser>(*Toks);
+    if (ParseJobs != 1)
+      Prepass = std::make_unique<DefinitionPrepass>(*Toks, ParseJobs);
+  } else {
+    if (Input)
+      Lex.setSource(std::move(Input));
+    P = std::make_unique<Parser>(Lex);
+  }
+
+  // Prime the first token.
+  fprintf(stderr, "ready> ");
+  P->getNextToken();
 
   // Run the main "interpreter loop" now.
-  MainLoop();
+  MainLoop(*P, Prepass.get());
+
+  if (Incremental)
+    CompiledDefinitions.finishVersion();
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
 
+  // The definition cache compiles each definition in one tier; it has no
+  // stubs to move callers from one tier to the next.
+  if (Incremental && Tiered) {
+    errs() << "-incremental and -tiered cannot be used together\n";
+    return 1;
+  }
+
+  // Lex straight out of the (mmap'ed) files when they are given; "-" keeps the
+  // interactive read-a-line-at-a-time behaviour.
+  if (InputFilenames.empty())
+    InputFilenames.push_back("-");
+  std::vector<std::unique_ptr<MemoryBuffer>> Inputs;
+  for (const std::string &Filename : InputFilenames) {
+    if (Filename == "-") {
+      Inputs.push_back(nullptr);
+      continue;
+    }
+    auto BufOrErr = MemoryBuffer::getFile(Filename);
+    if (std::error_code EC = BufOrErr.getError()) {
+      errs() << "Could not open input file '" << Filename
+             << "': " << EC.message() << "\n";
+      return 1;
+    }
+    Inputs.push_back(std::move(*BufOrErr));
+  }
+
+  // Initialize the LLVM backend.  The bytecode VM has no use for it.
+  if (Engine == EngineKind::JIT || Bench != BenchNone) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  }
+
+  if (Bench != BenchNone)
+    return runBenchmark(std::move(Inputs.front()));
+
+  if (Engine == EngineKind::JIT) {
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    InitializeModuleAndPassManager();
+  }
+
+  for (auto &Input : Inputs)
+    RunScript(std::move(Input));
+
+  if (TimePassesIsEnabled)
+    ThePassTimes.print(errs());
   return 0;
-}
\ No newline at end of file
+}